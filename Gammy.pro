@@ -28,9 +28,9 @@ win32 {
 }
 
 unix {
-    HEADERS += src/dspctl-xlib.h
-    SOURCES += src/dspctl-xlib.cpp
-    LIBS += -lX11 -lXxf86vm -lXext
+    HEADERS += src/dspctl-xlib.h src/capture-trace.h
+    SOURCES += src/dspctl-xlib.cpp src/capture-trace.cpp
+    LIBS += -lX11 -lXxf86vm -lXext -lXss -lXdamage -lXfixes -lXrender -lXrandr
 
     isEmpty(PREFIX) {
         PREFIX = /usr
@@ -66,7 +66,15 @@ HEADERS += src/mainwindow.h src/utils.h \
     src/tempscheduler.h \
     src/cfg.h \
     src/RangeSlider.h \
-    src/defs.h
+    src/defs.h \
+    src/capture.h \
+    src/capture-synth.h \
+    src/clock.h \
+    src/luma.h \
+    src/sampler.h \
+    src/workers.h \
+    src/weights.h \
+    src/ramp.h
 
 SOURCES += src/main.cpp src/mainwindow.cpp src/utils.cpp \
     src/component.cpp \
@@ -74,7 +82,15 @@ SOURCES += src/main.cpp src/mainwindow.cpp src/utils.cpp \
     src/mediator.cpp \
     src/tempscheduler.cpp \
     src/cfg.cpp \
-    src/RangeSlider.cpp
+    src/RangeSlider.cpp \
+    src/capture.cpp \
+    src/capture-synth.cpp \
+    src/clock.cpp \
+    src/luma.cpp \
+    src/sampler.cpp \
+    src/workers.cpp \
+    src/weights.cpp \
+    src/ramp.cpp
 
 FORMS += src/mainwindow.ui \
     src/tempscheduler.ui \
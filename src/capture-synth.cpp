@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include "capture-synth.h"
+#include "defs.h"
+#include "utils.h"
+
+SyntheticSource::SyntheticSource(int monitors, int width, int height) : width(std::max(width, 16)), height(std::max(height, 16))
+{
+	for (int i = 0; i < monitors; ++i)
+		names.push_back("synthetic-" + std::to_string(i));
+
+	bufs.resize(monitors, std::vector<uint8_t>(size_t(this->width) * this->height * 4));
+
+	LOGI << "Synthetic capture: " << monitors << " * " << this->width << '*' << this->height;
+}
+
+std::vector<std::string> SyntheticSource::monitorNames() const
+{
+	return names;
+}
+
+void SyntheticSource::render(size_t monitor)
+{
+	// Each monitor is out of phase with the others
+	const double phase = frame * 0.02 + monitor * 1.7;
+	const uint8_t bg   = uint8_t(127.5 + 127.5 * std::sin(phase));
+
+	const int wnd_w = width / 4;
+	const int wnd_h = height / 4;
+	const int wnd_x = int(frame * 8 % uint64_t(width - wnd_w));
+	const int wnd_y = (height - wnd_h) / 2;
+
+	for (int y = 0; y < height; ++y) {
+		uint8_t *row = &bufs[monitor][size_t(y) * width * 4];
+		memset(row, bg, size_t(width) * 4);
+
+		if (y >= wnd_y && y < wnd_y + wnd_h)
+			memset(row + wnd_x * 4, 255, size_t(wnd_w) * 4);
+	}
+}
+
+std::vector<int> SyntheticSource::getMonitorsBrightness()
+{
+	std::vector<int> brt(names.size());
+
+	for (size_t i = 0; i < names.size(); ++i) {
+		render(i);
+		brt[i] = calcSampledBrightness(grids, PixelFormat(), bufs[i].data(), width, height, width * 4, brtWeights(width, height));
+	}
+
+	++frame;
+	return brt;
+}
+
+std::vector<Image> SyntheticSource::lastImages() const
+{
+	std::vector<Image> imgs;
+
+	for (const auto &buf : bufs)
+		imgs.push_back({ buf.data(), width, height, width * 4, 4, PixelFormat() });
+
+	return imgs;
+}
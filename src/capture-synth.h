@@ -0,0 +1,36 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef CAPTURE_SYNTH_H
+#define CAPTURE_SYNTH_H
+
+#include <cstdint>
+#include "capture.h"
+#include "sampler.h"
+
+/**
+ * Generates frames in memory, so that the whole brightness pipeline
+ * can run and be profiled without a display server.
+ * Each monitor shows a background slowly fading between dark and bright,
+ * with a white window sliding across it.
+ */
+class SyntheticSource : public CaptureSource
+{
+public:
+	SyntheticSource(int monitors, int width, int height);
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+	std::vector<Image> lastImages() const override;
+private:
+	int width;
+	int height;
+	uint64_t frame = 0;
+	std::vector<std::string> names;
+	std::vector<std::vector<uint8_t>> bufs;
+	SampleGrids grids;
+	void render(size_t monitor);
+};
+
+#endif // CAPTURE_SYNTH_H
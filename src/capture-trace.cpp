@@ -0,0 +1,312 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include "capture-trace.h"
+#include "utils.h"
+
+// TraceSource -----------------------------------------------------------
+
+TraceSource::TraceSource(const std::string &path)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd == -1) {
+		LOGE << "Unable to open trace: " << path;
+		return;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		LOGE << "Empty trace: " << path;
+		close(fd);
+		return;
+	}
+
+	void *p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		LOGE << "Unable to map trace: " << path;
+		return;
+	}
+
+	map    = reinterpret_cast<const uint8_t*>(p);
+	map_sz = size_t(st.st_size);
+
+	size_t off = 0;
+
+	const auto read = [&] (void *dst, size_t sz) {
+		if (off + sz > map_sz)
+			return false;
+		memcpy(dst, map + off, sz);
+		off += sz;
+		return true;
+	};
+
+	char     magic[4];
+	uint32_t version, monitors;
+
+	if (!read(magic, sizeof(magic)) || memcmp(magic, trace_magic, sizeof(magic)) != 0
+	    || !read(&version, sizeof(version)) || version != trace_version
+	    || !read(&monitors, sizeof(monitors)) || !read(&width, sizeof(width)) || !read(&height, sizeof(height))
+	    || width == 0 || height == 0) {
+		LOGE << "Invalid trace header: " << path;
+		frame_count = 0;
+		return;
+	}
+
+	for (uint32_t i = 0; i < monitors; ++i) {
+		uint32_t len;
+		if (!read(&len, sizeof(len)) || off + len > map_sz) {
+			LOGE << "Invalid trace header: " << path;
+			return;
+		}
+		names.emplace_back(reinterpret_cast<const char*>(map + off), len);
+		off += len;
+	}
+
+	frames_offset = off;
+	frame_sz      = sizeof(int64_t) + size_t(monitors) * width * height * 4;
+	frame_count   = (map_sz - frames_offset) / frame_sz;
+	start         = std::chrono::steady_clock::now();
+
+	LOGI << "Trace: " << frame_count << " frames, " << monitors << " * " << width << '*' << height;
+}
+
+TraceSource::~TraceSource()
+{
+	if (map)
+		munmap(const_cast<uint8_t*>(map), map_sz);
+}
+
+bool TraceSource::valid() const noexcept
+{
+	return frame_count > 0 && !names.empty();
+}
+
+std::vector<std::string> TraceSource::monitorNames() const
+{
+	return names;
+}
+
+int64_t TraceSource::frameTime(size_t idx) const noexcept
+{
+	int64_t ms;
+	memcpy(&ms, map + frames_offset + idx * frame_sz, sizeof(ms));
+	return ms;
+}
+
+const uint8_t* TraceSource::framePixels(size_t idx) const noexcept
+{
+	return map + frames_offset + idx * frame_sz + sizeof(int64_t);
+}
+
+/**
+ * When a frame should be shown, measured from the start of the trace.
+ */
+std::chrono::steady_clock::time_point TraceSource::frameDue(size_t idx) const noexcept
+{
+	return start + std::chrono::milliseconds(frameTime(idx) - frameTime(0));
+}
+
+std::vector<int> TraceSource::getMonitorsBrightness()
+{
+	// Captures that came early (timeouts, forced captures) don't move the replay forward
+	if (std::chrono::steady_clock::now() >= frameDue(cur)) {
+		last = cur;
+
+		if (++cur == frame_count) {
+			LOGD << "Trace finished. Restarting.";
+			cur   = 0;
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	std::vector<int> brt;
+	brt.reserve(names.size());
+
+	const uint8_t *px      = framePixels(last);
+	const size_t   img_sz  = size_t(width) * height * 4;
+
+	for (size_t i = 0; i < names.size(); ++i)
+		brt.push_back(calcBrightness(const_cast<uint8_t*>(px + i * img_sz), img_sz, 4, 1));
+
+	return brt;
+}
+
+std::vector<Image> TraceSource::lastImages() const
+{
+	std::vector<Image> imgs;
+
+	const uint8_t *px     = framePixels(last);
+	const size_t   img_sz = size_t(width) * height * 4;
+
+	for (size_t i = 0; i < names.size(); ++i)
+		imgs.push_back({ px + i * img_sz, int(width), int(height), int(width) * 4, 4, PixelFormat() });
+
+	return imgs;
+}
+
+bool TraceSource::detectsChanges() const
+{
+	return true;
+}
+
+/**
+ * Waits until the next frame is due, measured from the start of the trace.
+ */
+bool TraceSource::waitForChange(int timeout_ms)
+{
+	using namespace std::chrono;
+
+	const auto due      = frameDue(cur);
+	const auto deadline = std::min(due, steady_clock::now() + milliseconds(timeout_ms));
+
+	std::unique_lock lock(wake_mtx);
+	wake_cv.wait_until(lock, deadline, [&] { return woken; });
+	woken = false;
+
+	return steady_clock::now() >= due;
+}
+
+void TraceSource::wake()
+{
+	{
+		std::lock_guard lock(wake_mtx);
+		woken = true;
+	}
+	wake_cv.notify_one();
+}
+
+// TraceRecorder ---------------------------------------------------------
+
+TraceRecorder::TraceRecorder(std::unique_ptr<CaptureSource> src, const std::string &path, int width, int height)
+    : src(std::move(src)), file(path, std::ios::binary | std::ios::trunc), width(std::max(width, 1)), height(std::max(height, 1))
+{
+	const auto names = this->src->monitorNames();
+
+	if (!file.good()) {
+		LOGE << "Unable to open trace for writing: " << path;
+		return;
+	}
+
+	const uint32_t hdr[4] { trace_version, uint32_t(names.size()), uint32_t(this->width), uint32_t(this->height) };
+	file.write(trace_magic, sizeof(trace_magic));
+	file.write(reinterpret_cast<const char*>(hdr), sizeof(hdr));
+
+	for (const auto &name : names) {
+		const uint32_t len = uint32_t(name.size());
+		file.write(reinterpret_cast<const char*>(&len), sizeof(len));
+		file.write(name.data(), len);
+	}
+
+	frame.resize(sizeof(int64_t) + names.size() * size_t(this->width) * this->height * 4);
+	start = std::chrono::steady_clock::now();
+
+	LOGI << "Recording trace to: " << path;
+}
+
+std::vector<std::string> TraceRecorder::monitorNames() const
+{
+	return src->monitorNames();
+}
+
+/**
+ * Averages every source pixel falling into each destination pixel.
+ */
+void TraceRecorder::downscale(const Image &img, uint8_t *out) const noexcept
+{
+	for (int oy = 0; oy < height; ++oy) {
+		const int y0 = oy * img.height / height;
+		const int y1 = std::max(y0 + 1, (oy + 1) * img.height / height);
+
+		for (int ox = 0; ox < width; ++ox) {
+			const int x0 = ox * img.width / width;
+			const int x1 = std::max(x0 + 1, (ox + 1) * img.width / width);
+
+			RgbSums s;
+
+			for (int y = y0; y < y1; ++y)
+				s += img.format.sum(img.data + int64_t(y) * img.bytes_per_line + int64_t(x0) * img.bytes_per_pixel, uint64_t(x1 - x0), 1);
+
+			// Traces are always 8 bit BGRx, whatever the source format
+			uint8_t *o = out + (size_t(oy) * width + ox) * 4;
+			o[0] = uint8_t(img.format.mean(s, 2));
+			o[1] = uint8_t(img.format.mean(s, 1));
+			o[2] = uint8_t(img.format.mean(s, 0));
+			o[3] = 0;
+		}
+	}
+}
+
+std::vector<int> TraceRecorder::getMonitorsBrightness()
+{
+	using namespace std::chrono;
+
+	const auto brt  = src->getMonitorsBrightness();
+	const auto imgs = src->lastImages();
+
+	if (!file.good())
+		return brt;
+
+	if (imgs.size() != brt.size()) {
+		LOGW << "Capture source has no frames to record";
+		file.close();
+		return brt;
+	}
+
+	const int64_t ms     = duration_cast<milliseconds>(steady_clock::now() - start).count();
+	const size_t  img_sz = size_t(width) * height * 4;
+
+	memcpy(frame.data(), &ms, sizeof(ms));
+
+	for (size_t i = 0; i < imgs.size(); ++i)
+		downscale(imgs[i], frame.data() + sizeof(ms) + i * img_sz);
+
+	file.write(reinterpret_cast<const char*>(frame.data()), std::streamsize(frame.size()));
+
+	return brt;
+}
+
+std::vector<Image> TraceRecorder::lastImages() const
+{
+	return src->lastImages();
+}
+
+bool TraceRecorder::detectsChanges() const
+{
+	return src->detectsChanges();
+}
+
+bool TraceRecorder::waitForChange(int timeout_ms)
+{
+	return src->waitForChange(timeout_ms);
+}
+
+void TraceRecorder::wake()
+{
+	src->wake();
+}
+
+bool TraceRecorder::detectsFocusChanges() const
+{
+	return src->detectsFocusChanges();
+}
+
+bool TraceRecorder::waitForFocusChange(int timeout_ms)
+{
+	return src->waitForFocusChange(timeout_ms);
+}
+
+bool TraceRecorder::fullscreen()
+{
+	return src->fullscreen();
+}
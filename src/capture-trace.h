@@ -0,0 +1,97 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef CAPTURE_TRACE_H
+#define CAPTURE_TRACE_H
+
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include "capture.h"
+#include "defs.h"
+
+/**
+ * Trace files hold a sequence of timestamped, downscaled frames:
+ *
+ * char     magic[4]     "GMTR"
+ * uint32_t version
+ * uint32_t monitors
+ * uint32_t width, height             size of every image
+ * { uint32_t len; char name[len]; }  one per monitor
+ * { int64_t ms; uint8_t bgrx[monitors][height][width][4]; } ...
+ *
+ * Values are in native byte order. The frame count follows from the file size,
+ * so a trace cut short by a crash is still readable.
+ */
+constexpr char     trace_magic[4] = { 'G', 'M', 'T', 'R' };
+constexpr uint32_t trace_version  = 1;
+
+/**
+ * Replays a trace from a memory-mapped file, looping at the end.
+ * Frames are returned one per capture, each no earlier than its timestamp.
+ * A capture before the next frame is due returns the previous one again.
+ */
+class TraceSource : public CaptureSource
+{
+public:
+	TraceSource(const std::string &path);
+	~TraceSource();
+	bool valid() const noexcept;
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+	std::vector<Image> lastImages() const override;
+	bool detectsChanges() const override;
+	bool waitForChange(int timeout_ms) override;
+	void wake() override;
+private:
+	const uint8_t *map = nullptr;
+	size_t   map_sz        = 0;
+	uint32_t width         = 0;
+	uint32_t height        = 0;
+	size_t   frames_offset = 0;
+	size_t   frame_sz      = 0;
+	size_t   frame_count   = 0;
+	size_t   cur           = 0;
+	size_t   last          = 0;
+	std::vector<std::string> names;
+	std::chrono::steady_clock::time_point start;
+
+	std::mutex wake_mtx;
+	convar     wake_cv;
+	bool       woken = false;
+
+	int64_t frameTime(size_t idx) const noexcept;
+	std::chrono::steady_clock::time_point frameDue(size_t idx) const noexcept;
+	const uint8_t* framePixels(size_t idx) const noexcept;
+};
+
+/**
+ * Wraps another source and writes every capture to a trace,
+ * downscaled to a fixed size with a box filter.
+ */
+class TraceRecorder : public CaptureSource
+{
+public:
+	TraceRecorder(std::unique_ptr<CaptureSource> src, const std::string &path, int width, int height);
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+	std::vector<Image> lastImages() const override;
+	bool detectsChanges() const override;
+	bool waitForChange(int timeout_ms) override;
+	void wake() override;
+	bool detectsFocusChanges() const override;
+	bool waitForFocusChange(int timeout_ms) override;
+	bool fullscreen() override;
+private:
+	std::unique_ptr<CaptureSource> src;
+	std::ofstream file;
+	int width;
+	int height;
+	std::vector<uint8_t> frame;
+	std::chrono::steady_clock::time_point start;
+	void downscale(const Image &img, uint8_t *out) const noexcept;
+};
+
+#endif // CAPTURE_TRACE_H
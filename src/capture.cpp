@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include "capture.h"
+#include "capture-synth.h"
+#include "cfg.h"
+#include "defs.h"
+
+#ifndef _WIN32
+#include "dspctl-xlib.h"
+#include "capture-trace.h"
+#endif
+
+static std::unique_ptr<CaptureSource> createSource(const std::string &name)
+{
+	LOGD << "Capture source: " << name;
+
+	if (name == "synthetic") {
+		const json &s = cfg["brt_synthetic"];
+		return std::make_unique<SyntheticSource>(s["monitors"].get<int>(), s["width"].get<int>(), s["height"].get<int>());
+	}
+
+#ifdef _WIN32
+	return nullptr;
+#else
+	if (name == "xlib")
+		return std::make_unique<Ximage>();
+
+	if (name == "trace") {
+		auto trace = std::make_unique<TraceSource>(cfg["brt_trace"].get<std::string>());
+
+		if (trace->valid())
+			return trace;
+
+		LOGE << "Trace unavailable. Using xshm.";
+		return std::make_unique<Xshm>();
+	}
+
+	if (name != "xshm") {
+		LOGW << "Unknown capture source: " << name << ". Using xshm.";
+	}
+
+	return std::make_unique<Xshm>();
+#endif
+}
+
+std::unique_ptr<CaptureSource> createCaptureSource(const std::string &name)
+{
+	auto src = createSource(name);
+
+#ifndef _WIN32
+	const std::string record_path = cfg["brt_trace_record"];
+
+	if (src && !record_path.empty())
+		return std::make_unique<TraceRecorder>(std::move(src), record_path, cfg["brt_trace_w"], cfg["brt_trace_h"]);
+#endif
+
+	return src;
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "luma.h"
+
+/**
+ * A view of captured pixels.
+ */
+struct Image
+{
+	const uint8_t *data;
+	int width;
+	int height;
+	int bytes_per_line;
+	int bytes_per_pixel;
+	PixelFormat format;
+};
+
+/**
+ * Where the screen content comes from.
+ * Sources report one brightness value (0-255) per monitor.
+ */
+class CaptureSource
+{
+public:
+	virtual ~CaptureSource() = default;
+	virtual std::vector<std::string> monitorNames() const = 0;
+	virtual std::vector<int> getMonitorsBrightness() = 0;
+
+	/**
+	 * The pixels behind the last getMonitorsBrightness(), one image per monitor.
+	 * Only valid until the next capture. Sources that don't keep them return nothing.
+	 */
+	virtual std::vector<Image> lastImages() const { return {}; }
+
+	/**
+	 * Sources that can tell when the screen changes block here until it does,
+	 * until the timeout expires or until wake() is called.
+	 * Returns false if nothing changed.
+	 */
+	virtual bool detectsChanges() const { return false; }
+	virtual bool waitForChange([[maybe_unused]] int timeout_ms) { return false; }
+	virtual void wake() {}
+
+	/**
+	 * Sources that can tell when the focused window or the workspace changes
+	 * block here until it does, until the timeout expires or until wake() is called.
+	 * Returns true if they changed, so that the change is captured right away.
+	 */
+	virtual bool detectsFocusChanges() const { return false; }
+	virtual bool waitForFocusChange([[maybe_unused]] int timeout_ms) { return false; }
+
+	/**
+	 * True if the focused window is fullscreen. Sources that can't tell return false.
+	 */
+	virtual bool fullscreen() { return false; }
+};
+
+/**
+ * Creates the source selected by name ("xshm", "xlib", "synthetic", "trace").
+ * If brt_trace_record is set, the source is wrapped in a recorder.
+ * Returns nullptr if the name is not available on this platform.
+ */
+std::unique_ptr<CaptureSource> createCaptureSource(const std::string &name);
+
+#endif // CAPTURE_H
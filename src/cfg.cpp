@@ -22,7 +22,36 @@ json getDefault()
 		{"brt_speed", 1000},
 		{"brt_threshold", 8},
 		{"brt_polling_rate", 100},
+		{"brt_polling_adaptive", true},
+		{"brt_polling_max", 2000},
+		{"brt_samples", 1024},
+		{"brt_sample_stride", 1024},
+		{"brt_metric", "mean"},
+		{"brt_percentile", 75.0},
+		{"brt_parallel_min", 1 << 22},
+		{"brt_threads", 0},
+		{"brt_weight", "none"},
+		{"brt_weight_outside", 0.25},
+		{"brt_weight_mask", ""},
 		{"brt_extend", false},
+		{"brt_capture", windows ? "dxgi" : "xshm"},
+		{"brt_synthetic", {{"monitors", 2}, {"width", 1920}, {"height", 1080}}},
+		{"brt_trace", ""},
+		{"brt_trace_record", ""},
+		{"brt_trace_w", 64},
+		{"brt_trace_h", 36},
+		{"brt_area", "screen"},
+		{"brt_damage", true},
+		{"brt_damage_timeout", 10000},
+		{"brt_damage_timeout_max", 60000},
+		{"brt_focus_events", true},
+		{"brt_fullscreen", "normal"},
+		{"brt_fullscreen_polling", 5000},
+		{"brt_tile_size", 256},
+		{"brt_downscale", false},
+		{"brt_downscale_w", 64},
+		{"brt_downscale_h", 36},
+		{"brt_monitors", json::object()},
 
 		{"temp_auto", false},
 		{"temp_fps", 45},
@@ -33,6 +62,13 @@ json getDefault()
 		{"temp_sunrise", "06:00:00"},
 		{"temp_sunset", "16:00:00"},
 
+		{"gamma_ramp_cache", 64},
+		{"gamma_calibration", true},
+
+		{"suspend_inactive", true},
+		{"suspend_idle_timeout", 3600},
+
+		{"clock", "system"},
 		{"log_level", plog::warning},
 		{"wnd_show_on_startup", false},
 		{"wnd_x", -1},
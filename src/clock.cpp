@@ -0,0 +1,176 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include "clock.h"
+
+// Clock -----------------------------------------------------------------
+
+bool Clock::wait(std::unique_lock<std::mutex> &lock, convar &cv, const std::function<bool()> &pred)
+{
+	return waitUntil(lock, cv, time_point::max(), pred);
+}
+
+bool Clock::waitFor(std::unique_lock<std::mutex> &lock, convar &cv, std::chrono::milliseconds d, const std::function<bool()> &pred)
+{
+	return waitUntil(lock, cv, now() + d, pred);
+}
+
+void Clock::sleepFor(std::chrono::milliseconds d)
+{
+	std::mutex mtx;
+	convar     cv;
+	std::unique_lock lock(mtx);
+	waitFor(lock, cv, d, [] { return false; });
+}
+
+// SystemClock -----------------------------------------------------------
+
+Clock::time_point SystemClock::now()
+{
+	return std::chrono::system_clock::now();
+}
+
+bool SystemClock::waitUntil(std::unique_lock<std::mutex> &lock, convar &cv, time_point deadline, const std::function<bool()> &pred)
+{
+	// Waiting until time_point::max() overflows in the conversion to the steady clock
+	if (deadline == time_point::max()) {
+		cv.wait(lock, pred);
+		return true;
+	}
+
+	return cv.wait_until(lock, deadline, pred);
+}
+
+void SystemClock::notify(convar &cv)
+{
+	cv.notify_one();
+}
+
+// SimClock --------------------------------------------------------------
+
+SimClock::SimClock(time_point start) : t(start)
+{
+}
+
+Clock::time_point SimClock::now()
+{
+	std::lock_guard lock(m);
+	return t;
+}
+
+bool SimClock::simulated() const
+{
+	return true;
+}
+
+void SimClock::addThread()
+{
+	std::lock_guard lock(m);
+	++threads;
+}
+
+void SimClock::removeThread()
+{
+	std::lock_guard lock(m);
+	--threads;
+	advance();
+}
+
+/**
+ * Called with m held. The waiter counts as running from now on.
+ */
+void SimClock::wake(Waiter &w)
+{
+	if (w.awake)
+		return;
+
+	w.awake = true;
+	--sleeping;
+	w.wake_cv.notify_one();
+}
+
+/**
+ * Called with m held. Once nobody is running, nothing can happen
+ * before the earliest deadline, so we can go straight to it.
+ */
+void SimClock::advance()
+{
+	if (sleeping < threads)
+		return;
+
+	time_point next = time_point::max();
+
+	for (const Waiter *w : waiters) {
+		if (!w->awake)
+			next = std::min(next, w->deadline);
+	}
+
+	if (next == time_point::max())
+		return;
+
+	t = std::max(t, next);
+
+	for (Waiter *w : waiters) {
+		if (w->deadline <= t)
+			wake(*w);
+	}
+}
+
+/**
+ * Waiters sleep on their own condition variable, guarded by m, so that
+ * waking them never races with going to sleep. The caller's lock is
+ * released meanwhile, as cv.wait would.
+ */
+bool SimClock::waitUntil(std::unique_lock<std::mutex> &lock, convar &cv, time_point deadline, const std::function<bool()> &pred)
+{
+	while (true) {
+		if (pred())
+			return true;
+
+		std::unique_lock clk(m);
+
+		if (t >= deadline)
+			return false;
+
+		// A notification sent before we registered is missed, but its effect isn't
+		if (pred())
+			return true;
+
+		Waiter w;
+		w.cv       = &cv;
+		w.deadline = deadline;
+		waiters.push_back(&w);
+		++sleeping;
+
+		lock.unlock();
+		advance();
+		w.wake_cv.wait(clk, [&] { return w.awake; });
+		waiters.erase(std::find(waiters.begin(), waiters.end(), &w));
+		clk.unlock();
+
+		lock.lock();
+	}
+}
+
+void SimClock::notify(convar &cv)
+{
+	std::lock_guard clk(m);
+
+	for (Waiter *w : waiters) {
+		if (w->cv == &cv)
+			wake(*w);
+	}
+}
+
+std::unique_ptr<Clock> createClock(const std::string &name)
+{
+	if (name == "simulated") {
+		LOGI << "Using simulated time";
+		return std::make_unique<SimClock>(std::chrono::system_clock::now());
+	}
+
+	return std::make_unique<SystemClock>();
+}
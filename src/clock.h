@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <thread>
+#include "defs.h"
+
+/**
+ * Source of time for GammaCtl. Every sleep and timed wait goes through it,
+ * so that transitions can be simulated without waiting for them.
+ */
+class Clock
+{
+public:
+	using time_point = std::chrono::system_clock::time_point;
+
+	virtual ~Clock() = default;
+	virtual time_point now() = 0;
+
+	/**
+	 * Waits on cv until pred is true or the deadline passes.
+	 * Returns pred(), like convar::wait_until.
+	 */
+	virtual bool waitUntil(std::unique_lock<std::mutex> &lock, convar &cv, time_point deadline, const std::function<bool()> &pred) = 0;
+
+	/**
+	 * Wakes the threads waiting on cv. Condition variables
+	 * waited on through the clock must be notified through it too.
+	 */
+	virtual void notify(convar &cv) = 0;
+
+	/**
+	 * Threads that wait on the clock are registered while they run.
+	 * A registered thread that isn't waiting keeps time still.
+	 */
+	virtual void addThread() {}
+	virtual void removeThread() {}
+	virtual bool simulated() const { return false; }
+
+	bool wait(std::unique_lock<std::mutex> &lock, convar &cv, const std::function<bool()> &pred);
+	bool waitFor(std::unique_lock<std::mutex> &lock, convar &cv, std::chrono::milliseconds d, const std::function<bool()> &pred);
+	void sleepFor(std::chrono::milliseconds d);
+
+	/**
+	 * Starts a registered thread. It's registered before it starts,
+	 * so time can't move before it gets to its first wait.
+	 */
+	template <class F>
+	std::thread spawn(F &&f)
+	{
+		addThread();
+		return std::thread([this, f = std::forward<F>(f)] () mutable {
+			f();
+			removeThread();
+		});
+	}
+};
+
+class SystemClock : public Clock
+{
+public:
+	time_point now() override;
+	bool waitUntil(std::unique_lock<std::mutex> &lock, convar &cv, time_point deadline, const std::function<bool()> &pred) override;
+	void notify(convar &cv) override;
+};
+
+/**
+ * Time only moves when every registered thread is waiting,
+ * and then it jumps straight to the earliest deadline.
+ * A thread counts as running from the moment it's woken, not when it
+ * gets scheduled, so the order of events doesn't depend on the OS.
+ */
+class SimClock : public Clock
+{
+public:
+	SimClock(time_point start);
+	time_point now() override;
+	bool waitUntil(std::unique_lock<std::mutex> &lock, convar &cv, time_point deadline, const std::function<bool()> &pred) override;
+	void notify(convar &cv) override;
+	void addThread() override;
+	void removeThread() override;
+	bool simulated() const override;
+private:
+	struct Waiter
+	{
+		convar     *cv = nullptr; // What the caller waits on
+		time_point  deadline;
+		convar      wake_cv;  // What it actually sleeps on, with m
+		bool        awake = false;
+	};
+	std::mutex m;
+	time_point t;
+	int threads  = 0;
+	int sleeping = 0;
+	std::vector<Waiter*> waiters;
+	void wake(Waiter &w);
+	void advance();
+};
+
+/**
+ * "system" or "simulated". Simulated time starts from the current time.
+ */
+std::unique_ptr<Clock> createClock(const std::string &name);
+
+#endif // CLOCK_H
@@ -23,6 +23,8 @@ public:
 		AUTO_BRT_TOGGLED,
 		AUTO_TEMP_TOGGLED,
 		SYSTEM_WAKE_UP,
+		SESSION_LOCKED,
+		SESSION_UNLOCKED,
 		APP_QUIT,
 		APP_QUIT_PURE_GAMMA,
 	};
@@ -77,4 +77,35 @@ constexpr std::array<double, 46 * 3> ingo_thies_table {
     1.00000000,  1.00000000,  1.00000000 // 6500K - 137
 };
 
+constexpr int ingo_thies_k_first = 2000;
+constexpr int ingo_thies_k_step  = 100;
+
+/**
+ * RGB multipliers of each temperature step, interpolated along the table
+ * at the step's color temperature. Step 0 is temp_k_min.
+ */
+inline constexpr auto temp_multipliers = [] {
+	constexpr int last = int(ingo_thies_table.size() / 3) - 1;
+
+	std::array<std::array<double, 3>, temp_steps_max + 1> t {};
+
+	for (int step = 0; step <= temp_steps_max; ++step) {
+		const double kelvin = temp_k_min + double(temp_k_max - temp_k_min) * step / temp_steps_max;
+		double pos = (kelvin - ingo_thies_k_first) / ingo_thies_k_step;
+
+		if (pos < 0)
+			pos = 0;
+		if (pos > last)
+			pos = last;
+
+		const int    i    = int(pos) < last ? int(pos) : last - 1;
+		const double frac = pos - i;
+
+		for (int ch = 0; ch < 3; ++ch)
+			t[step][ch] = (1 - frac) * ingo_thies_table[i * 3 + ch] + frac * ingo_thies_table[(i + 1) * 3 + ch];
+	}
+
+	return t;
+}();
+
 #endif // DEFS_H
@@ -99,6 +99,47 @@ void GDI::setGamma(int brt_step, int temp_step)
 	}
 }
 
+/**
+ * Auto brightness only runs on the primary screen, which is the only "monitor" here.
+ */
+void GDI::setMonitorsGamma(const std::vector<int> &brt_steps, int temp)
+{
+	GDI::setGamma(brt_steps.empty() ? brt_steps_max : brt_steps[0], temp);
+}
+
+/**
+ * The ramps aren't read back here, so they are always assumed to need reapplying.
+ */
+bool GDI::gammaChanged() const noexcept
+{
+	return true;
+}
+
+/**
+ * Every set already sends the ramps.
+ */
+void GDI::forceGamma() noexcept
+{
+}
+
+/**
+ * Only idle time is known here. Blanking and locking aren't detected.
+ */
+bool GDI::screenInactive(int idle_timeout_s) const noexcept
+{
+	LASTINPUTINFO info { sizeof(LASTINPUTINFO), 0 };
+
+	if (idle_timeout_s <= 0 || !GetLastInputInfo(&info))
+		return false;
+
+	return GetTickCount() - info.dwTime >= DWORD(idle_timeout_s) * 1000;
+}
+
+std::vector<std::string> GDI::monitorNames() const
+{
+	return { "primary" };
+}
+
 void GDI::setInitialGamma([[maybe_unused]] bool set_previous)
 {
 	// @TODO: restore previous gamma
@@ -135,7 +176,7 @@ int GDI::getScreenBrightness() noexcept
 	DeleteDC(tmp);
 	DeleteDC(dc);
 
-	return calcBrightness(buf.data(), buf.size(), 4, 1024);
+	return calcSampledBrightness(grids, PixelFormat(), buf.data(), width, height, width * 4, brtWeights(width, height));
 }
 
 DXGI::DXGI()
@@ -322,7 +363,12 @@ int  DXGI::getScreenBrightness()
 	staging_tex->Release();
 	d3d_context->Release();
 
-	return calcBrightness(reinterpret_cast<uint8_t*>(map.pData), map.DepthPitch, 4, 1024);
+	return calcSampledBrightness(grids, PixelFormat(), reinterpret_cast<uint8_t*>(map.pData), int(tex_desc.Width), int(tex_desc.Height), int(map.RowPitch), brtWeights(int(tex_desc.Width), int(tex_desc.Height)));
+}
+
+std::vector<int> DXGI::getMonitorsBrightness()
+{
+	return { getScreenBrightness() };
 }
 
 void DXGI::restart()
@@ -355,3 +401,18 @@ void DXGI::restart()
 
 	output1->Release();
 }
+
+DxgiCapture::DxgiCapture(DXGI &dxgi) : dxgi(dxgi)
+{
+
+}
+
+std::vector<std::string> DxgiCapture::monitorNames() const
+{
+	return dxgi.monitorNames();
+}
+
+std::vector<int> DxgiCapture::getMonitorsBrightness()
+{
+	return dxgi.getMonitorsBrightness();
+}
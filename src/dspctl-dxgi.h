@@ -13,6 +13,8 @@
 #include <stdint.h>
 #include <vector>
 #include <string>
+#include "capture.h"
+#include "sampler.h"
 
 #pragma comment(lib, "gdi32.lib")
 #pragma comment(lib, "user32.lib")
@@ -28,8 +30,14 @@ public:
 
 	int  getScreenBrightness() noexcept;
 	void setGamma(int brt, int temp);
+	void setMonitorsGamma(const std::vector<int> &brt_steps, int temp);
 	void setInitialGamma(bool set_previous);
+	void forceGamma() noexcept;
+	bool screenInactive(int idle_timeout_s) const noexcept;
+	bool gammaChanged() const noexcept;
+	std::vector<std::string> monitorNames() const;
 protected:
+	SampleGrids grids;
 	void createDCs(const std::wstring &primary_screen_name);
 private:
 	std::vector<HDC> hdcs;
@@ -53,6 +61,7 @@ public:
 	~DXGI();
 
 	int getScreenBrightness();
+	std::vector<int> getMonitorsBrightness();
 private:
 	ID3D11Device*           d3d_device;
 	ID3D11DeviceContext*    d3d_context;
@@ -67,6 +76,20 @@ private:
 	void restart();
 };
 
+/**
+ * DXGI also holds the gamma, which GammaCtl inherits.
+ * This forwards captures to that same instance.
+ */
+class DxgiCapture : public CaptureSource
+{
+public:
+	DxgiCapture(DXGI &dxgi);
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+private:
+	DXGI &dxgi;
+};
+
 typedef DXGI DspCtl;
 
 #endif // DXGIDUPL_H
@@ -4,13 +4,42 @@
  */
 
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/xf86vmode.h>
 #include <X11/extensions/XShm.h>
+#include <X11/extensions/dpms.h>
+#include <X11/extensions/scrnsaver.h>
 #include "dspctl-xlib.h"
 #include "defs.h"
 #include "utils.h"
+#include "luma.h"
+#include "cfg.h"
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <chrono>
+#include <numeric>
+#include <algorithm>
+
+static XErrorHandler default_error_handler = nullptr;
+
+/**
+ * Windows can be destroyed between two requests about them, like reading
+ * the active window and then its geometry. Those errors are expected, the rest go to Xlib.
+ */
+static int errorHandler(Display *dsp, XErrorEvent *ev)
+{
+	if (ev->error_code == BadWindow || ev->error_code == BadDrawable) {
+		LOGV << "Ignoring X error " << int(ev->error_code) << " on " << ev->resourceid;
+		return 0;
+	}
+
+	return default_error_handler(dsp, ev);
+}
 
 XLib::XLib()
 {
@@ -18,12 +47,22 @@ XLib::XLib()
 		LOGE << "Failed to initialize XThreads. App may crash unexpectedly.";
 	}
 
+	if (!default_error_handler)
+		default_error_handler = XSetErrorHandler(errorHandler);
+
 	dsp              = XOpenDisplay(nullptr);
 	default_root_wnd = DefaultRootWindow(dsp);
 	default_scr      = DefaultScreenOfDisplay(dsp);
 	default_scr_num  = XDefaultScreen(dsp);
 	scr_count        = XScreenCount(dsp);
 	LOGV << "XDisplay initialized. Screens: " << scr_count;
+
+	// Interned once, as each one is a round trip
+	active_wnd_atom = XInternAtom(dsp, "_NET_ACTIVE_WINDOW", False);
+	wm_state_atom   = XInternAtom(dsp, "_NET_WM_STATE", False);
+	fullscreen_atom = XInternAtom(dsp, "_NET_WM_STATE_FULLSCREEN", False);
+
+	queryMonitors();
 }
 
 XLib::~XLib()
@@ -32,12 +71,438 @@ XLib::~XLib()
 		XCloseDisplay(dsp);
 }
 
-int XLib::getScreenBrightness() noexcept
+std::vector<std::string> XLib::monitorNames() const
 {
-	const auto img = XGetImage(dsp, default_root_wnd, 0, 0, default_scr->width, default_scr->height, AllPlanes, ZPixmap);
-	int brt = calcBrightness(reinterpret_cast<uint8_t*>(img->data), img->bytes_per_line * img->height, img->bits_per_pixel / 8, 1024);
-	img->f.destroy_image(img);
-	return brt;
+	std::vector<std::string> names;
+
+	for (const auto &m : monitors)
+		names.push_back(m.name);
+
+	return names;
+}
+
+/**
+ * Fills the monitor list from XRandR. Without it, or without any active monitor,
+ * the whole root window is treated as a single monitor.
+ */
+void XLib::queryMonitors()
+{
+	monitors.clear();
+
+	// Xlib only updates the screen size on RandR events read from this connection, which nobody reads
+	XWindowAttributes root_attrs;
+	if (XGetWindowAttributes(dsp, default_root_wnd, &root_attrs)) {
+		default_scr->width  = root_attrs.width;
+		default_scr->height = root_attrs.height;
+	}
+
+	int ev_base, err_base;
+	int major = 0, minor = 0;
+
+	if (XRRQueryExtension(dsp, &ev_base, &err_base))
+		XRRQueryVersion(dsp, &major, &minor);
+
+	if (major > 1 || (major == 1 && minor >= 5)) {
+		int n = 0;
+		XRRMonitorInfo *info = XRRGetMonitors(dsp, default_root_wnd, True, &n);
+
+		for (int i = 0; i < n; ++i) {
+			// Clip to the root window, as captures outside of it fail
+			const int x0 = std::max(info[i].x, 0);
+			const int y0 = std::max(info[i].y, 0);
+			const int x1 = std::min(info[i].x + info[i].width, default_scr->width);
+			const int y1 = std::min(info[i].y + info[i].height, default_scr->height);
+
+			if (x1 <= x0 || y1 <= y0)
+				continue;
+
+			Monitor m;
+			char *name = XGetAtomName(dsp, info[i].name);
+			m.name = name ? name : "";
+			XFree(name);
+			m.x = x0;
+			m.y = y0;
+			m.w = x1 - x0;
+			m.h = y1 - y0;
+			m.outputs.assign(info[i].outputs, info[i].outputs + info[i].noutput);
+			monitors.push_back(m);
+
+			LOGV << "Monitor " << m.name << ": " << m.w << '*' << m.h << '+' << m.x << '+' << m.y;
+		}
+
+		if (info)
+			XRRFreeMonitors(info);
+	} else {
+		LOGW << "XRandR 1.5 unavailable. Treating all screens as one.";
+	}
+
+	if (monitors.empty())
+		monitors.push_back({ "default", 0, 0, default_scr->width, default_scr->height, {} });
+}
+
+/**
+ * The focused top level window, as set by the window manager.
+ * None if there's none, or the window manager doesn't tell.
+ */
+Window XLib::activeWindowId() const
+{
+	Atom           type;
+	int            format;
+	unsigned long  n, after;
+	unsigned char *data = nullptr;
+
+	if (XGetWindowProperty(dsp, default_root_wnd, active_wnd_atom, 0, 1, False, XA_WINDOW, &type, &format, &n, &after, &data) != Success || !data)
+		return None;
+
+	const Window wnd = (n == 1 && format == 32) ? *reinterpret_cast<Window*>(data) : None;
+	XFree(data);
+
+	return wnd;
+}
+
+/**
+ * Root window geometry of the focused window. Empty if there's none.
+ */
+Rect XLib::activeWindow() const
+{
+	const Window wnd = activeWindowId();
+
+	XWindowAttributes attr;
+
+	if (wnd == None || !XGetWindowAttributes(dsp, wnd, &attr) || attr.map_state != IsViewable)
+		return {};
+
+	int    x, y;
+	Window child;
+
+	if (!XTranslateCoordinates(dsp, wnd, default_root_wnd, 0, 0, &x, &y, &child))
+		return {};
+
+	return { x, y, attr.width, attr.height };
+}
+
+/**
+ * True if the window manager made the focused window fullscreen.
+ */
+bool XLib::activeWindowFullscreen() const
+{
+	const Window wnd = activeWindowId();
+
+	if (wnd == None)
+		return false;
+
+	Atom           type;
+	int            format;
+	unsigned long  n, after;
+	unsigned char *data = nullptr;
+
+	if (XGetWindowProperty(dsp, wnd, wm_state_atom, 0, 64, False, XA_ATOM, &type, &format, &n, &after, &data) != Success || !data)
+		return false;
+
+	const Atom *atoms = reinterpret_cast<Atom*>(data);
+	const bool  found = format == 32 && std::find(atoms, atoms + n, fullscreen_atom) != atoms + n;
+	XFree(data);
+
+	return found;
+}
+
+/**
+ * Weights of a monitor, for an image of it scaled to width*height.
+ * The active window (in root coordinates) is clipped to the monitor.
+ */
+WeightMap XLib::monitorWeights(size_t mon_idx, const Rect &active, int width, int height) const
+{
+	const Monitor &mon = monitors[mon_idx];
+
+	Rect focus;
+
+	if (!active.empty()) {
+		const int x0 = std::max(active.x, mon.x);
+		const int y0 = std::max(active.y, mon.y);
+		const int x1 = std::min(active.x + active.w, mon.x + mon.w);
+		const int y1 = std::min(active.y + active.h, mon.y + mon.h);
+
+		if (x1 > x0 && y1 > y0) {
+			focus.x = int(int64_t(x0 - mon.x) * width / mon.w);
+			focus.y = int(int64_t(y0 - mon.y) * height / mon.h);
+			focus.w = std::max(1, int(int64_t(x1 - mon.x) * width / mon.w) - focus.x);
+			focus.h = std::max(1, int(int64_t(y1 - mon.y) * height / mon.h) - focus.y);
+		}
+	}
+
+	return brtWeights(width, height, focus);
+}
+
+/**
+ * The active window, only looked up when brt_weight follows it.
+ */
+Rect XLib::weightFocus() const
+{
+	return weightingFromName(cfg["brt_weight"]) == Weighting::window ? activeWindow() : Rect();
+}
+
+// Randr -----------------------------------------------------------------
+
+Randr::Randr()
+{
+	int ev_base, err_base;
+	int major = 0, minor = 0;
+
+	/* Calibration loaders publish the profile they apply as _ICC_PROFILE,
+	 * on the root window or on the output. Only then is a ramp set by
+	 * another program taken as the new calibration. */
+	icc_atom = XInternAtom(dsp, "_ICC_PROFILE", False);
+	XSelectInput(dsp, default_root_wnd, PropertyChangeMask);
+
+	if (!XRRQueryExtension(dsp, &ev_base, &err_base) || !XRRQueryVersion(dsp, &major, &minor)) {
+		LOGW << "XRandR unavailable";
+		return;
+	}
+
+	if (major < 1 || (major == 1 && minor < 2)) {
+		LOGW << "XRandR " << major << '.' << minor << " has no per-CRTC gamma";
+		return;
+	}
+
+	randr_ev_base = ev_base;
+	XRRSelectInput(dsp, default_root_wnd, RROutputPropertyNotifyMask);
+
+	XRRScreenResources *res = XRRGetScreenResourcesCurrent(dsp, default_root_wnd);
+
+	if (!res) {
+		LOGE << "Failed to get XRandR screen resources";
+		return;
+	}
+
+	for (int i = 0; i < res->ncrtc; ++i) {
+		XRRCrtcInfo *info = XRRGetCrtcInfo(dsp, res, res->crtcs[i]);
+
+		if (!info)
+			continue;
+
+		// Disabled CRTCs have no mode
+		if (info->mode == None || info->noutput == 0) {
+			XRRFreeCrtcInfo(info);
+			continue;
+		}
+
+		const int ramp_sz = XRRGetCrtcGammaSize(dsp, res->crtcs[i]);
+
+		if (ramp_sz == 0) {
+			LOGW << "CRTC " << res->crtcs[i] << " has no gamma ramp";
+			XRRFreeCrtcInfo(info);
+			continue;
+		}
+
+		// The monitor driving one of our outputs. Without XRandR 1.5 there's only one.
+		size_t mon_idx = 0;
+
+		for (size_t m = 0; m < monitors.size(); ++m) {
+			const auto &outs = monitors[m].outputs;
+			if (std::find_first_of(outs.begin(), outs.end(), info->outputs, info->outputs + info->noutput) != outs.end()) {
+				mon_idx = m;
+				break;
+			}
+		}
+
+		Crtc c;
+		c.id        = res->crtcs[i];
+		c.monitor   = mon_idx;
+		c.ramp      = XRRAllocGamma(ramp_sz);
+		c.init_ramp = XRRGetCrtcGamma(dsp, c.id);
+
+		if (c.init_ramp && c.calib.set(c.init_ramp->red, c.init_ramp->green, c.init_ramp->blue, size_t(c.init_ramp->size)) && !c.calib.identity()) {
+			LOGI << "CRTC " << c.id << " is calibrated, adjusting on top of it";
+		}
+
+		crtcs.push_back(c);
+
+		LOGV << "CRTC " << c.id << ": ramp size " << ramp_sz << ", monitor " << monitors[mon_idx].name;
+
+		XRRFreeCrtcInfo(info);
+	}
+
+	XRRFreeScreenResources(res);
+}
+
+Randr::~Randr()
+{
+	LOGD << "Gamma ramp cache: " << ramps.hits() << " hits, " << ramps.misses() << " misses";
+
+	for (auto &c : crtcs) {
+		XRRFreeGamma(c.ramp);
+		if (c.init_ramp)
+			XRRFreeGamma(c.init_ramp);
+	}
+}
+
+bool Randr::randrGammaAvailable() const noexcept
+{
+	return !crtcs.empty();
+}
+
+static uint64_t crtcRampHash(const XRRCrtcGamma *g) noexcept
+{
+	const size_t n = size_t(g->size);
+	return rampHash(g->blue, n, rampHash(g->green, n, rampHash(g->red, n)));
+}
+
+/**
+ * Takes one brightness step per monitor. The requests are only buffered
+ * while filling, then sent together with a single flush.
+ * Ramps identical to the last one sent to a CRTC are skipped,
+ * which is most animation frames on small ramps.
+ */
+void Randr::setCrtcsGamma(const std::vector<int> &brt_steps, int temp)
+{
+	std::lock_guard lock(gamma_mtx);
+
+	const bool compose = calibrate && cfg["gamma_calibration"].get<bool>();
+	bool sent = false;
+
+	for (auto &c : crtcs) {
+		const int brt = c.monitor < brt_steps.size() ? brt_steps[c.monitor] : brt_steps_max;
+		ramps.fill(c.ramp->red, c.ramp->green, c.ramp->blue, c.ramp->size, brt, temp);
+
+		if (compose)
+			c.calib.apply(c.ramp->red, c.ramp->green, c.ramp->blue, size_t(c.ramp->size));
+
+		const uint64_t h = crtcRampHash(c.ramp);
+
+		if (h == c.uploaded)
+			continue;
+
+		XRRSetCrtcGamma(dsp, c.id, c.ramp);
+		c.uploaded = h;
+		sent       = true;
+	}
+
+	if (sent)
+		XFlush(dsp);
+}
+
+void Randr::setInitialCrtcsGamma()
+{
+	std::lock_guard lock(gamma_mtx);
+
+	for (auto &c : crtcs) {
+		if (c.init_ramp)
+			XRRSetCrtcGamma(dsp, c.id, c.init_ramp);
+		c.uploaded = 0;
+	}
+
+	XFlush(dsp);
+}
+
+/**
+ * Makes the next set upload every ramp, even those identical to the last ones sent.
+ */
+void Randr::forceCrtcsGamma()
+{
+	std::lock_guard lock(gamma_mtx);
+
+	for (auto &c : crtcs) {
+		c.uploaded = 0;
+		c.foreign.clear();
+	}
+}
+
+/**
+ * True if a calibration profile was published since the last read-back, or the one before:
+ * loaders may set the ramps before or after publishing it.
+ * Nothing else reads events on this connection, so they are only drained here.
+ */
+bool Randr::calibrationReloaded()
+{
+	XEvent ev;
+
+	while (XCheckTypedWindowEvent(dsp, default_root_wnd, PropertyNotify, &ev)) {
+		if (ev.xproperty.atom == icc_atom)
+			reload_checks = 2;
+	}
+
+	while (randr_ev_base != -1 && XCheckTypedEvent(dsp, randr_ev_base + RRNotify, &ev)) {
+		const auto *e = reinterpret_cast<const XRROutputPropertyNotifyEvent*>(&ev);
+		if (e->subtype == RRNotify_OutputProperty && e->property == icc_atom)
+			reload_checks = 2;
+	}
+
+	if (reload_checks == 0)
+		return false;
+
+	--reload_checks;
+	return true;
+}
+
+/**
+ * Reads the ramps back, to find out if another program replaced them.
+ * They are compared with what was sent, allowing for the driver's rounding.
+ * A changed CRTC is sent its ramp again on the next set.
+ * The replaced ramp is kept, and only becomes the calibration we adjust on top of
+ * once a profile is published. Linear ramps, like a driver reset after a wake up,
+ * never do. The ramps restored on exit stay the ones found at startup.
+ */
+bool Randr::crtcsGammaChanged()
+{
+	std::lock_guard lock(gamma_mtx);
+
+	const bool reloaded = calibrationReloaded();
+	bool       changed  = false;
+
+	for (auto &c : crtcs) {
+		bool fresh = false;
+
+		if (c.uploaded != 0) {
+			XRRCrtcGamma *g = XRRGetCrtcGamma(dsp, c.id);
+
+			if (!g)
+				continue;
+
+			const size_t n  = size_t(c.ramp->size);
+			const bool same = g->size == c.ramp->size
+			                  && rampsMatch(c.ramp->red, g->red, n)
+			                  && rampsMatch(c.ramp->green, g->green, n)
+			                  && rampsMatch(c.ramp->blue, g->blue, n);
+
+			if (!same) {
+				LOGI << "Gamma of CRTC " << c.id << " was changed externally";
+
+				if (g->size == c.ramp->size && !linearRamps(g->red, g->green, g->blue, n)) {
+					c.foreign.assign(g->red, g->red + n);
+					c.foreign.insert(c.foreign.end(), g->green, g->green + n);
+					c.foreign.insert(c.foreign.end(), g->blue, g->blue + n);
+					fresh = true;
+				}
+
+				c.uploaded = 0;
+				changed    = true;
+			}
+
+			XRRFreeGamma(g);
+		}
+
+		// Ramps replaced without a profile in sight are only kept for the next read-back
+		if (!reloaded) {
+			if (!fresh)
+				c.foreign.clear();
+			continue;
+		}
+
+		if (c.foreign.empty())
+			continue;
+
+		const size_t n = c.foreign.size() / 3;
+
+		if (c.calib.set(&c.foreign[0], &c.foreign[n], &c.foreign[2 * n], n)) {
+			LOGI << "CRTC " << c.id << " has a new calibration, adjusting on top of it";
+			c.uploaded = 0;
+			changed    = true;
+		}
+
+		c.foreign.clear();
+	}
+
+	return changed;
 }
 
 // Vidmode ---------------------------------------------------------------
@@ -46,6 +511,18 @@ Vidmode::Vidmode()
 {
 	int ev_base, err_base;
 
+	dpms_available  = DPMSQueryExtension(dsp, &ev_base, &err_base) && DPMSCapable(dsp);
+	saver_available = XScreenSaverQueryExtension(dsp, &ev_base, &err_base);
+
+	if (!saver_available) {
+		LOGW << "MIT-SCREEN-SAVER unavailable. Can't tell when the screen saver is on or the user is idle.";
+	}
+
+	if (randrGammaAvailable())
+		return;
+
+	LOGI << "Falling back to XF86VidMode gamma";
+
 	if (!XF86VidModeQueryExtension(dsp, &ev_base, &err_base)) {
 		LOGE << "Failed to query VidMode";
 	}
@@ -71,6 +548,11 @@ Vidmode::Vidmode()
 	if (!XF86VidModeGetGammaRamp(dsp, default_scr_num, ramp_sz, r, g, b)) {
 		LOGE << "Failed to get initial gamma ramp";
 		initial_ramp_exists = false;
+		return;
+	}
+
+	if (calib.set(r, g, b, size_t(ramp_sz)) && !calib.identity()) {
+		LOGI << "Gamma is calibrated, adjusting on top of it";
 	}
 }
 
@@ -79,102 +561,496 @@ Vidmode::~Vidmode()
 	init_ramp.clear();
 }
 
-void Vidmode::fillRamp(const int brt_step, const int temp_step)
+void Vidmode::setGamma(int scr_br, int temp)
+{
+	setMonitorsGamma(std::vector<int>(monitors.size(), scr_br), temp);
+}
+
+/**
+ * VidMode has a single ramp, so it gets the average of the monitor steps.
+ */
+void Vidmode::setMonitorsGamma(const std::vector<int> &brt_steps, int temp)
+{
+	if (randrGammaAvailable())
+		return setCrtcsGamma(brt_steps, temp);
+
+	if (brt_steps.empty())
+		return;
+
+	const int scr_br = std::accumulate(brt_steps.begin(), brt_steps.end(), 0) / int(brt_steps.size());
+
+	std::lock_guard lock(gamma_mtx);
+
+	ramps.fill(&ramp[0], &ramp[ramp_sz], &ramp[2 * ramp_sz], ramp_sz, scr_br, temp);
+
+	if (calibrate && cfg["gamma_calibration"].get<bool>())
+		calib.apply(&ramp[0], &ramp[ramp_sz], &ramp[2 * ramp_sz], size_t(ramp_sz));
+
+	const uint64_t h = rampHash(ramp.data(), 3 * size_t(ramp_sz));
+
+	if (h == uploaded)
+		return;
+
+	XF86VidModeSetGammaRamp(dsp, 0, ramp_sz, &ramp[0], &ramp[ramp_sz], &ramp[2 * ramp_sz]);
+	uploaded = h;
+}
+
+/**
+ * Same as Randr::crtcsGammaChanged, for the VidMode ramp.
+ */
+bool Vidmode::gammaChanged()
 {
-	/**
-	 * The ramp multiplier equals 32 when ramp_sz = 2048, 64 when 1024, etc.
-	 * Assuming ramp_sz = 2048 and pure state (default brightness/temp)
-	 * the RGB channels look like:
-	 * [ 0, 32, 64, 96, ... UINT16_MAX - 32 ]
-	 */
-	uint16_t *r = &ramp[0 * ramp_sz];
-	uint16_t *g = &ramp[1 * ramp_sz];
-	uint16_t *b = &ramp[2 * ramp_sz];
+	if (randrGammaAvailable())
+		return crtcsGammaChanged();
+
+	std::lock_guard lock(gamma_mtx);
+
+	if (uploaded == 0)
+		return false;
+
+	std::vector<uint16_t> cur(3 * size_t(ramp_sz));
+
+	if (!XF86VidModeGetGammaRamp(dsp, default_scr_num, ramp_sz, &cur[0], &cur[ramp_sz], &cur[2 * ramp_sz]))
+		return false;
+
+	const bool reloaded = calibrationReloaded();
+	bool       changed  = false;
+	bool       fresh    = false;
+
+	if (!rampsMatch(ramp.data(), cur.data(), cur.size())) {
+		LOGI << "Gamma was changed externally";
+
+		if (!linearRamps(&cur[0], &cur[ramp_sz], &cur[2 * ramp_sz], size_t(ramp_sz))) {
+			foreign = cur;
+			fresh   = true;
+		}
+
+		uploaded = 0;
+		changed  = true;
+	}
 
-	const double r_mult = interpTemp(temp_step, 0),
-	             g_mult = interpTemp(temp_step, 1),
-	             b_mult = interpTemp(temp_step, 2);
+	if (!reloaded && !fresh)
+		foreign.clear();
 
-	const int    ramp_mult = (UINT16_MAX + 1) / ramp_sz;
-	const double brt_mult  = normalize(brt_step, 0, brt_steps_max) * ramp_mult;
+	if (reloaded && !foreign.empty()) {
+		if (calib.set(&foreign[0], &foreign[ramp_sz], &foreign[2 * ramp_sz], size_t(ramp_sz))) {
+			LOGI << "Gamma has a new calibration, adjusting on top of it";
+			uploaded = 0;
+			changed  = true;
+		}
 
-	for (int i = 0; i < ramp_sz; ++i) {
-		const int val = std::clamp(int(i * brt_mult), 0, UINT16_MAX);
-		r[i] = uint16_t(val * r_mult);
-		g[i] = uint16_t(val * g_mult);
-		b[i] = uint16_t(val * b_mult);
+		foreign.clear();
 	}
+
+	return changed;
 }
 
-void Vidmode::setGamma(int scr_br, int temp)
+/**
+ * For when the ramps may have been lost without us knowing, like after a suspend.
+ */
+void Vidmode::forceGamma()
 {
-	fillRamp(scr_br, temp);
-	XF86VidModeSetGammaRamp(dsp, 0, ramp_sz, &ramp[0], &ramp[ramp_sz], &ramp[2 * ramp_sz]);
+	if (randrGammaAvailable())
+		return forceCrtcsGamma();
+
+	std::lock_guard lock(gamma_mtx);
+	uploaded = 0;
+	foreign.clear();
 }
 
 void Vidmode::setInitialGamma(bool set_previous)
 {
+	if (set_previous && randrGammaAvailable()) {
+		LOGI << "Setting previous gamma";
+		setInitialCrtcsGamma();
+		return;
+	}
+
 	if (set_previous && initial_ramp_exists) {
 		LOGI << "Setting previous gamma";
+		std::lock_guard lock(gamma_mtx);
 		XF86VidModeSetGammaRamp(dsp, default_scr_num, ramp_sz, &init_ramp[0*ramp_sz], &init_ramp[1*ramp_sz], &init_ramp[2*ramp_sz]);
+		uploaded = 0;
 	} else {
 		LOGI << "Setting pure gamma";
+		{
+			std::lock_guard lock(gamma_mtx);
+			calibrate = false;
+		}
 		setGamma(brt_steps_max, 0);
 	}
 }
 
-// XShm ------------------------------------------------------------------
-
-Xshm::Xshm()
+/**
+ * True if the monitors are powered down, the screen saver (or a locker using it) is on,
+ * or no input came for idle_timeout_s seconds (never, if 0).
+ */
+bool Vidmode::screenInactive(int idle_timeout_s)
 {
-	int ignore;
-
-	if (!XQueryExtension(dsp, "MIT-SHM", &ignore, &ignore, &ignore)) {
-		LOGE << "Failed to query XShm";
+	if (dpms_available) {
+		CARD16 level;
+		BOOL   enabled;
+		if (DPMSInfo(dsp, &level, &enabled) && enabled && level != DPMSModeOn)
+			return true;
 	}
 
-	int major, minor;
-	int pixmaps;
-
-	if (!XShmQueryVersion(dsp, &major, &minor, &pixmaps)) {
-		LOGE << "Failed to query Xshm version";
+	if (saver_available) {
+		XScreenSaverInfo info;
+		if (XScreenSaverQueryInfo(dsp, default_root_wnd, &info)) {
+			if (info.state == ScreenSaverOn)
+				return true;
+			if (idle_timeout_s > 0 && info.idle >= uint64_t(idle_timeout_s) * 1000)
+				return true;
+		}
 	}
 
-	LOGV << "XImage support: " << (pixmaps == 1);
-	LOGV << "Pixmap support: " << (pixmaps == 2);
-
-	default_vis = XDefaultVisual(dsp, 0);
-	shi = createImage();
+	return false;
+}
 
-	if (!shi) {
-		LOGE << "Shared image unavailable";
-	}
+/**
+ * Picks the luma kernel for the layout of an image.
+ */
+static PixelFormat imageFormat(const XImage *img)
+{
+	return pixelFormat(img->bits_per_pixel, uint32_t(img->red_mask), uint32_t(img->green_mask), uint32_t(img->blue_mask), img->byte_order == MSBFirst);
 }
 
-Xshm::~Xshm()
+// Ximage ----------------------------------------------------------------
+
+std::vector<std::string> Ximage::monitorNames() const
 {
-	XDestroyImage(shi);
-	shmdt(shminfo.shmaddr);
-	shmctl(shminfo.shmid, IPC_RMID, nullptr);
+	return XLib::monitorNames();
 }
 
-XImage* Xshm::createImage()
+std::vector<int> Ximage::getMonitorsBrightness()
 {
-	XImage *img = XShmCreateImage(dsp, default_vis, default_scr->root_depth, ZPixmap, nullptr, &shminfo, default_scr->width, default_scr->height);
+	std::vector<int> brt;
+	brt.reserve(monitors.size());
 
-	if (!img) {
-		LOGF << "XShmCreateImage failed";
-		exit(1);
-	}
+	const Rect active = weightFocus();
 
-	shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height, IPC_CREAT | 0600);
+	for (size_t i = 0; i < monitors.size(); ++i) {
+		const Monitor &m = monitors[i];
+		const auto img = XGetImage(dsp, default_root_wnd, m.x, m.y, m.w, m.h, AllPlanes, ZPixmap);
 
-	if (shminfo.shmid == -1) {
-		LOGF << "shmget failed";
-		exit(1);
+		if (!fmt)
+			fmt = imageFormat(img);
+
+		brt.push_back(calcSampledBrightness(grids, *fmt, reinterpret_cast<uint8_t*>(img->data), img->width, img->height, img->bytes_per_line, monitorWeights(i, active, m.w, m.h)));
+		img->f.destroy_image(img);
 	}
 
-	void *shm = shmat(shminfo.shmid, nullptr, SHM_RDONLY);
+	return brt;
+}
+
+// XEvents ---------------------------------------------------------------
+
+XEvents::XEvents()
+{
+	if (pipe(wake_fd) == -1) {
+		LOGE << "Failed to create wakeup pipe";
+	} else {
+		fcntl(wake_fd[0], F_SETFL, O_NONBLOCK);
+		fcntl(wake_fd[1], F_SETFL, O_NONBLOCK);
+	}
+
+	dsp = XOpenDisplay(nullptr);
+
+	if (!dsp) {
+		LOGE << "Failed to open event display";
+		return;
+	}
+
+	// The window manager sets these on the root window
+	active_wnd_atom = XInternAtom(dsp, "_NET_ACTIVE_WINDOW", False);
+	desktop_atom    = XInternAtom(dsp, "_NET_CURRENT_DESKTOP", False);
+	wm_state_atom   = XInternAtom(dsp, "_NET_WM_STATE", False);
+	XSelectInput(dsp, DefaultRootWindow(dsp), PropertyChangeMask);
+	trackActiveWindow();
+
+	int randr_err_base;
+	if (XRRQueryExtension(dsp, &randr_ev_base, &randr_err_base))
+		XRRSelectInput(dsp, DefaultRootWindow(dsp), RRScreenChangeNotifyMask);
+	else
+		randr_ev_base = -1;
+
+	int err_base;
+
+	if (!XDamageQueryExtension(dsp, &damage_ev_base, &err_base)) {
+		LOGW << "XDamage unavailable. Falling back to polling.";
+		return;
+	}
+
+	int major, minor;
+	XDamageQueryVersion(dsp, &major, &minor);
+
+	// Needed to learn which areas were damaged. Without it, the whole screen is assumed.
+	int fixes_ev_base, fixes_err_base;
+	if (XFixesQueryExtension(dsp, &fixes_ev_base, &fixes_err_base)) {
+		int fixes_major, fixes_minor;
+		XFixesQueryVersion(dsp, &fixes_major, &fixes_minor);
+		damage_region = XFixesCreateRegion(dsp, nullptr, 0);
+	}
+
+	/* NonEmpty sends a single event when the damage region stops being empty.
+	 * Nothing else is sent until we subtract it, no matter how much is drawn. */
+	damage = XDamageCreate(dsp, DefaultRootWindow(dsp), XDamageReportNonEmpty);
+	XFlush(dsp);
+
+	LOGV << "XDamage " << major << '.' << minor << " initialized";
+}
+
+XEvents::~XEvents()
+{
+	if (dsp) {
+		if (damage_region)
+			XFixesDestroyRegion(dsp, damage_region);
+		if (damage)
+			XDamageDestroy(dsp, damage);
+		XCloseDisplay(dsp);
+	}
+
+	for (int fd : wake_fd) {
+		if (fd != -1)
+			close(fd);
+	}
+}
+
+bool XEvents::damageAvailable() const noexcept
+{
+	return damage != 0;
+}
+
+bool XEvents::focusAvailable() const noexcept
+{
+	return dsp != nullptr;
+}
+
+void XEvents::readEvents() noexcept
+{
+	bool activated = false;
+
+	while (XPending(dsp)) {
+		XEvent ev;
+		XNextEvent(dsp, &ev);
+
+		if (ev.type == damage_ev_base + XDamageNotify) {
+			pending |= damaged;
+		} else if (ev.type == PropertyNotify) {
+			const Atom a = ev.xproperty.atom;
+			if (a == active_wnd_atom || a == desktop_atom)
+				pending |= focused;
+			if (a == active_wnd_atom)
+				activated = true;
+			else if (a == wm_state_atom && ev.xproperty.window == active_wnd)
+				pending |= state;
+		} else if (randr_ev_base != -1 && ev.type == randr_ev_base + RRScreenChangeNotify) {
+			pending |= layout;
+		}
+	}
+
+	if (activated)
+		trackActiveWindow();
+}
+
+/**
+ * Moves the selection of property changes to the window that is now active,
+ * so that it going fullscreen is reported as well.
+ * A window destroyed meanwhile only causes a BadWindow, which is ignored.
+ */
+void XEvents::trackActiveWindow() noexcept
+{
+	Atom           type;
+	int            format;
+	unsigned long  n, after;
+	unsigned char *data = nullptr;
+	Window         wnd  = None;
+
+	if (XGetWindowProperty(dsp, DefaultRootWindow(dsp), active_wnd_atom, 0, 1, False, XA_WINDOW, &type, &format, &n, &after, &data) == Success && data) {
+		if (n == 1 && format == 32)
+			wnd = *reinterpret_cast<Window*>(data);
+		XFree(data);
+	}
+
+	if (wnd == active_wnd)
+		return;
+
+	if (active_wnd != None)
+		XSelectInput(dsp, active_wnd, NoEventMask);
+	if (wnd != None)
+		XSelectInput(dsp, wnd, PropertyChangeMask);
+
+	XFlush(dsp);
+
+	active_wnd = wnd;
+	pending   |= state;
+}
+
+/**
+ * Blocks until one of the events happens, the timeout expires or wake() is called.
+ * Returns the events that happened, or 0 on timeout.
+ * Events that aren't waited for are kept for a later call.
+ */
+unsigned XEvents::wait(int timeout_ms, unsigned events) noexcept
+{
+	using namespace std::chrono;
+
+	// Without XDamage, the screen is always assumed to have changed
+	if ((events & damaged) && !damage)
+		return damaged;
+
+	if (!dsp)
+		return 0;
+
+	const auto deadline = steady_clock::now() + milliseconds(timeout_ms);
+
+	while (true) {
+		readEvents();
+
+		if (const unsigned ev = pending & events) {
+			pending &= ~ev;
+			if (ev & damaged)
+				fetchDamage();
+			return ev;
+		}
+
+		const auto ms = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+
+		if (ms <= 0)
+			return 0;
+
+		pollfd fds[2] {
+			{ ConnectionNumber(dsp), POLLIN, 0 },
+			{ wake_fd[0], POLLIN, 0 }
+		};
+
+		if (poll(fds, 2, int(ms)) == -1 && errno != EINTR) {
+			LOGE << "poll failed: " << errno;
+			return 0;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			char buf[16];
+			while (read(wake_fd[0], buf, sizeof(buf)) > 0);
+			return woken;
+		}
+	}
+}
+
+/**
+ * Moves the accumulated damage into damage_rects, clearing it on the server.
+ */
+void XEvents::fetchDamage() noexcept
+{
+	damage_rects.clear();
+
+	if (!damage_region) {
+		XDamageSubtract(dsp, damage, None, None);
+		XFlush(dsp);
+		const Screen *scr = DefaultScreenOfDisplay(dsp);
+		damage_rects.push_back({ 0, 0, uint16_t(scr->width), uint16_t(scr->height) });
+		return;
+	}
+
+	XDamageSubtract(dsp, damage, None, damage_region);
+
+	int n = 0;
+	XRectangle *rects = XFixesFetchRegion(dsp, damage_region, &n);
+
+	if (rects) {
+		damage_rects.assign(rects, rects + n);
+		XFree(rects);
+	}
+}
+
+/**
+ * Returns the events that already happened, without waiting. Not for damage.
+ */
+unsigned XEvents::take(unsigned events) noexcept
+{
+	if (!dsp)
+		return 0;
+
+	readEvents();
+
+	const unsigned ev = pending & events & ~damaged;
+	pending &= ~ev;
+
+	return ev;
+}
+
+const std::vector<XRectangle>& XEvents::damagedAreas() const noexcept
+{
+	return damage_rects;
+}
+
+void XEvents::wake() noexcept
+{
+	if (wake_fd[1] != -1) {
+		[[maybe_unused]] const auto r = write(wake_fd[1], "w", 1);
+	}
+}
+
+// XShm ------------------------------------------------------------------
+
+Xshm::Xshm()
+{
+	int ignore;
+
+	if (!XQueryExtension(dsp, "MIT-SHM", &ignore, &ignore, &ignore)) {
+		LOGE << "Failed to query XShm";
+	}
+
+	int major, minor;
+	int pixmaps;
+
+	if (!XShmQueryVersion(dsp, &major, &minor, &pixmaps)) {
+		LOGE << "Failed to query Xshm version";
+	}
+
+	LOGV << "XImage support: " << (pixmaps == 1);
+	LOGV << "Pixmap support: " << (pixmaps == 2);
+
+	default_vis = XDefaultVisual(dsp, 0);
+
+	// Every image shares the default visual, so they have the same layout
+	XImage *probe = XCreateImage(dsp, default_vis, default_scr->root_depth, ZPixmap, 0, nullptr, 1, 1, 32, 0);
+	fmt = imageFormat(probe);
+	XDestroyImage(probe);
+
+	mon_imgs.resize(monitors.size());
+
+	for (size_t i = 0; i < monitors.size(); ++i)
+		mon_imgs[i].area = { 0, 0, monitors[i].w, monitors[i].h };
+
+	createTiles();
+	updateThumbnail();
+}
+
+Xshm::~Xshm()
+{
+	destroyThumbnail();
+	destroyImages();
+}
+
+XImage* Xshm::createImage(XShmSegmentInfo &shminfo, int width, int height)
+{
+	XImage *img = XShmCreateImage(dsp, default_vis, default_scr->root_depth, ZPixmap, nullptr, &shminfo, width, height);
+
+	if (!img) {
+		LOGF << "XShmCreateImage failed";
+		exit(1);
+	}
+
+	shminfo.shmid = shmget(IPC_PRIVATE, img->bytes_per_line * img->height, IPC_CREAT | 0600);
+
+	if (shminfo.shmid == -1) {
+		LOGF << "shmget failed";
+		exit(1);
+	}
+
+	// Writable, so that single tiles can be copied into the monitor images
+	void *shm = shmat(shminfo.shmid, nullptr, 0);
 
 	if (shm == reinterpret_cast<void*>(-1)) {
 		LOGF << "shmat failed";
@@ -193,9 +1069,655 @@ XImage* Xshm::createImage()
 	return img;
 }
 
-int Xshm::getScreenBrightness() noexcept
+void Xshm::destroyImage(XImage *img, XShmSegmentInfo &shminfo)
+{
+	XShmDetach(dsp, &shminfo);
+	XDestroyImage(img);
+	shmdt(shminfo.shmaddr);
+	shmctl(shminfo.shmid, IPC_RMID, nullptr);
+}
+
+/**
+ * The full size segments are only allocated by the first capture that needs them,
+ * so they take no memory while every capture is downscaled.
+ */
+void Xshm::createImages()
+{
+	if (tile_img)
+		return;
+
+	for (size_t i = 0; i < monitors.size(); ++i)
+		mon_imgs[i].img = createImage(mon_imgs[i].shminfo, monitors[i].w, monitors[i].h);
+
+	tile_img = createImage(tile_shminfo, tile_sz, tile_sz);
+
+	// Nothing has been read into them yet
+	for (auto &t : tiles)
+		t.dirty = true;
+
+	LOGV << "Full size segments allocated";
+}
+
+void Xshm::destroyImages()
+{
+	if (!tile_img)
+		return;
+
+	destroyImage(tile_img, tile_shminfo);
+	tile_img = nullptr;
+
+	for (auto &m : mon_imgs) {
+		destroyImage(m.img, m.shminfo);
+		m.img = nullptr;
+	}
+}
+
+bool Xshm::useDamage() const noexcept
+{
+	return cfg["brt_damage"].get<bool>() && events.damageAvailable();
+}
+
+/**
+ * Fullscreen windows can also switch to the thumbnail, leaving them most of the bandwidth.
+ */
+bool Xshm::useDownscale() const noexcept
+{
+	if (!thumb_img)
+		return false;
+
+	if (cfg["brt_downscale"].get<bool>())
+		return true;
+
+	return cfg["brt_fullscreen"] == "downscale" && active_fullscreen;
+}
+
+/**
+ * Asks the server again only when the active window or its state changed.
+ * Without the event display, there's no telling, so it asks every time.
+ */
+void Xshm::updateFullscreen() noexcept
+{
+	if (!events.focusAvailable() || events.take(XEvents::state))
+		active_fullscreen = activeWindowFullscreen();
+}
+
+bool Xshm::useWindowArea() const noexcept
+{
+	return cfg["brt_area"] == "window";
+}
+
+/**
+ * Bytes per row the server uses for an image of the given width.
+ */
+static int rowBytes(const XImage *img, int width)
 {
-	XShmGetImage(dsp, default_root_wnd, shi, 0, 0, AllPlanes);
-	return calcBrightness(reinterpret_cast<uint8_t*>(shi->data), shi->bytes_per_line * shi->height, shi->bits_per_pixel / 8, 1024);
+	return ((width * img->bits_per_pixel + img->bitmap_pad - 1) / img->bitmap_pad) * (img->bitmap_pad / 8);
 }
 
+/**
+ * Reads a rectangle of a monitor (in its own coordinates) into the start of its segment.
+ * The server lays out the data according to the requested size,
+ * so the row length has to match the rectangle while fetching.
+ */
+void Xshm::fetchArea(size_t mon_idx, const Rect &r) noexcept
+{
+	const Monitor &mon = monitors[mon_idx];
+	MonitorImage  &m   = mon_imgs[mon_idx];
+
+	if (r.x == 0 && r.y == 0 && r.w == mon.w && r.h == mon.h) {
+		XShmGetImage(dsp, default_root_wnd, m.img, mon.x, mon.y, AllPlanes);
+		m.area = r;
+		return;
+	}
+
+	const int full_bpl = m.img->bytes_per_line;
+
+	m.img->width          = r.w;
+	m.img->height         = r.h;
+	m.img->bytes_per_line = rowBytes(m.img, r.w);
+
+	XShmGetImage(dsp, default_root_wnd, m.img, mon.x + r.x, mon.y + r.y, AllPlanes);
+
+	m.img->width          = mon.w;
+	m.img->height         = mon.h;
+	m.img->bytes_per_line = full_bpl;
+	m.area                = r;
+}
+
+/**
+ * Updates the brightness of every monitor.
+ * With damage, monitors with no dirty tiles don't transfer anything.
+ */
+/**
+ * Starts over with the new monitors. Segments are allocated again on the next capture.
+ */
+void Xshm::updateLayout()
+{
+	const auto names = monitorNames();
+
+	destroyImages();
+	destroyThumbnail();
+	queryMonitors();
+
+	mon_imgs.assign(monitors.size(), MonitorImage());
+
+	for (size_t i = 0; i < monitors.size(); ++i)
+		mon_imgs[i].area = { 0, 0, monitors[i].w, monitors[i].h };
+
+	createTiles();
+
+	LOGI << "Screen layout changed: " << monitors.size() << " monitors, " << default_scr->width << '*' << default_scr->height;
+
+	if (monitorNames() != names) {
+		LOGW << "Monitors were added or removed. Restart Gammy for per-monitor brightness to follow them.";
+	}
+}
+
+void Xshm::capture() noexcept
+{
+	if (events.take(XEvents::layout))
+		updateLayout();
+
+	updateThumbnail();
+	updateFullscreen();
+
+	downscaled = useDownscale();
+
+	if (downscaled)
+		return captureThumbnail();
+
+	createImages();
+
+	if (useWindowArea() && captureWindow())
+		return;
+
+	const bool damage = useDamage();
+
+	// Switching to a histogram metric needs every tile's histogram
+	if (brtUsesHistogram() != tile_hists) {
+		tile_hists = !tile_hists;
+		for (auto &t : tiles)
+			t.dirty = true;
+	}
+
+	const Rect active = weightFocus();
+
+	for (size_t i = 0; i < monitors.size(); ++i) {
+		MonitorImage &m = mon_imgs[i];
+		const WeightMap weights = monitorWeights(i, active, monitors[i].w, monitors[i].h);
+
+		if (damage) {
+			updateTileWeights(i, weights);
+			refreshTiles(i);
+			m.brt = tilesBrightness(i);
+			continue;
+		}
+
+		fetchArea(i, { 0, 0, monitors[i].w, monitors[i].h });
+		m.brt = calcSampledBrightness(grids, fmt, reinterpret_cast<uint8_t*>(m.img->data), m.img->width, m.img->height, m.img->bytes_per_line, weights);
+	}
+}
+
+/**
+ * Reads only the part of each monitor covered by the focused window.
+ * Monitors it isn't on keep their last brightness.
+ * Returns false without a focused window, so that the whole screen is read instead.
+ */
+bool Xshm::captureWindow() noexcept
+{
+	const Rect active = activeWindow();
+
+	if (active.empty())
+		return false;
+
+	for (size_t i = 0; i < monitors.size(); ++i) {
+		const Monitor &mon = monitors[i];
+		MonitorImage  &m   = mon_imgs[i];
+
+		const int x0 = std::max(active.x, mon.x);
+		const int y0 = std::max(active.y, mon.y);
+		const int x1 = std::min(active.x + active.w, mon.x + mon.w);
+		const int y1 = std::min(active.y + active.h, mon.y + mon.h);
+
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+
+		const Rect r { x0 - mon.x, y0 - mon.y, x1 - x0, y1 - y0 };
+
+		fetchArea(i, r);
+		m.brt = calcSampledBrightness(grids, fmt, reinterpret_cast<uint8_t*>(m.img->data), r.w, r.h, rowBytes(m.img, r.w), brtWeights(r.w, r.h));
+	}
+
+	return true;
+}
+
+std::vector<std::string> Xshm::monitorNames() const
+{
+	return XLib::monitorNames();
+}
+
+std::vector<int> Xshm::getMonitorsBrightness()
+{
+	capture();
+
+	std::vector<int> brt(mon_imgs.size());
+
+	for (size_t i = 0; i < mon_imgs.size(); ++i)
+		brt[i] = mon_imgs[i].brt;
+
+	return brt;
+}
+
+/**
+ * The monitor images of the last capture, or their parts of the thumbnail.
+ */
+std::vector<Image> Xshm::lastImages() const
+{
+	std::vector<Image> imgs;
+
+	if (downscaled) {
+		const double sx = double(thumb_img->width) / default_scr->width;
+		const double sy = double(thumb_img->height) / default_scr->height;
+		const int    bpp = thumb_img->bits_per_pixel / 8;
+
+		for (const auto &mon : monitors) {
+			const int x = std::min(int(mon.x * sx), thumb_img->width - 1);
+			const int y = std::min(int(mon.y * sy), thumb_img->height - 1);
+			const int w = std::clamp(int(mon.w * sx), 1, thumb_img->width - x);
+			const int h = std::clamp(int(mon.h * sy), 1, thumb_img->height - y);
+			const auto data = reinterpret_cast<const uint8_t*>(thumb_img->data) + int64_t(y) * thumb_img->bytes_per_line + int64_t(x) * bpp;
+			imgs.push_back({ data, w, h, thumb_img->bytes_per_line, bpp, fmt });
+		}
+		return imgs;
+	}
+
+	if (!tile_img)
+		return imgs;
+
+	for (const auto &m : mon_imgs) {
+		const int bpl = m.area.w == m.img->width ? m.img->bytes_per_line : rowBytes(m.img, m.area.w);
+		imgs.push_back({ reinterpret_cast<const uint8_t*>(m.img->data), m.area.w, m.area.h, bpl, m.img->bits_per_pixel / 8, fmt });
+	}
+
+	return imgs;
+}
+
+bool Xshm::detectsChanges() const
+{
+	return useDamage();
+}
+
+void Xshm::wake()
+{
+	events.wake();
+}
+
+/**
+ * Returns true if the screen was damaged before the timeout.
+ * Otherwise, every tile is refreshed on the next capture,
+ * in case something was drawn without being reported.
+ */
+bool Xshm::waitForChange(int timeout_ms)
+{
+	const unsigned ev = events.wait(timeout_ms, XEvents::damaged | XEvents::focused);
+
+	if (ev & XEvents::damaged) {
+		for (const auto &r : events.damagedAreas())
+			markDirty(r);
+		return true;
+	}
+
+	// Nothing reported, or a new window in front: read everything
+	for (auto &t : tiles)
+		t.dirty = true;
+
+	return ev & XEvents::focused;
+}
+
+bool Xshm::fullscreen()
+{
+	updateFullscreen();
+	return active_fullscreen;
+}
+
+bool Xshm::detectsFocusChanges() const
+{
+	return cfg["brt_focus_events"].get<bool>() && events.focusAvailable();
+}
+
+/**
+ * Returns true if the focused window or the workspace changed.
+ * wake() ends the wait too, but isn't a focus change.
+ * Damage reported meanwhile is kept for waitForChange.
+ */
+bool Xshm::waitForFocusChange(int timeout_ms)
+{
+	const unsigned ev = events.wait(timeout_ms, XEvents::focused);
+
+	if (ev & XEvents::focused) {
+		for (auto &t : tiles)
+			t.dirty = true;
+	}
+
+	return ev & XEvents::focused;
+}
+
+// Tiles -----------------------------------------------------------------
+
+// Samples taken per tile. The stride is derived from this and the tile size.
+static constexpr int tile_samples = 256;
+
+static int tileStride(const Tile &t)
+{
+	/* A stride sharing a divisor with the width would keep hitting
+	 * the same few columns, so we look for the next coprime one.
+	 * A denser brt_sample_stride takes more samples. */
+	int stride = std::clamp(t.w * t.h / tile_samples, 1, std::max(1, cfg["brt_sample_stride"].get<int>()));
+
+	while (std::gcd(stride, t.w) != 1)
+		++stride;
+
+	return stride;
+}
+
+/**
+ * Each monitor gets its own grid, starting at its top left corner.
+ */
+void Xshm::createTiles()
+{
+	tile_sz = std::max(16, cfg["brt_tile_size"].get<int>());
+
+	tiles.clear();
+
+	for (size_t i = 0; i < monitors.size(); ++i) {
+		const Monitor &mon = monitors[i];
+		MonitorImage  &m   = mon_imgs[i];
+
+		m.tiles_begin = tiles.size();
+		m.tile_cols   = (mon.w + tile_sz - 1) / tile_sz;
+		m.tile_rows   = (mon.h + tile_sz - 1) / tile_sz;
+
+		for (int y = 0; y < mon.h; y += tile_sz) {
+			for (int x = 0; x < mon.w; x += tile_sz) {
+				Tile t;
+				t.x = mon.x + x;
+				t.y = mon.y + y;
+				t.w = std::min(tile_sz, mon.w - x);
+				t.h = std::min(tile_sz, mon.h - y);
+				tiles.push_back(t);
+			}
+		}
+
+		LOGV << "Tiles on " << mon.name << ": " << m.tile_cols << '*' << m.tile_rows << " (" << tile_sz << " px)";
+	}
+}
+
+void Xshm::markDirty(const XRectangle &r) noexcept
+{
+	for (size_t i = 0; i < monitors.size(); ++i) {
+		const Monitor      &mon = monitors[i];
+		const MonitorImage &m   = mon_imgs[i];
+
+		const int rx0 = std::max(int(r.x), mon.x);
+		const int ry0 = std::max(int(r.y), mon.y);
+		const int rx1 = std::min(r.x + r.width, mon.x + mon.w);
+		const int ry1 = std::min(r.y + r.height, mon.y + mon.h);
+
+		if (rx1 <= rx0 || ry1 <= ry0)
+			continue;
+
+		const int x0 = (rx0 - mon.x) / tile_sz;
+		const int y0 = (ry0 - mon.y) / tile_sz;
+		const int x1 = (rx1 - 1 - mon.x) / tile_sz;
+		const int y1 = (ry1 - 1 - mon.y) / tile_sz;
+
+		for (int y = y0; y <= y1; ++y)
+			for (int x = x0; x <= x1; ++x)
+				tiles[m.tiles_begin + y * m.tile_cols + x].dirty = true;
+	}
+}
+
+/**
+ * Tiles weigh as much as the map averages over them.
+ * Only recomputed when the map changes, like when another window gets the focus.
+ */
+void Xshm::updateTileWeights(size_t mon_idx, const WeightMap &weights) noexcept
+{
+	const Monitor &mon = monitors[mon_idx];
+	MonitorImage  &m   = mon_imgs[mon_idx];
+
+	if (m.weights == weights)
+		return;
+
+	m.weights = weights;
+
+	const auto begin = tiles.begin() + m.tiles_begin;
+	const auto end   = begin + m.tile_cols * m.tile_rows;
+
+	bool counted = false;
+
+	for (auto t = begin; t != end; ++t) {
+		t->weight = weights.average({ t->x - mon.x, t->y - mon.y, t->w, t->h });
+		counted  |= t->weight > 0;
+	}
+
+	// Otherwise the brightness would read as 0
+	if (!counted) {
+		LOGW << "Brightness weights are 0 on every tile of " << mon.name << ". Ignoring them.";
+		for (auto t = begin; t != end; ++t)
+			t->weight = 1;
+	}
+}
+
+void Xshm::refreshTiles(size_t mon_idx) noexcept
+{
+	const Monitor &mon = monitors[mon_idx];
+	MonitorImage  &m   = mon_imgs[mon_idx];
+
+	const auto begin = tiles.begin() + m.tiles_begin;
+	const auto end   = begin + m.tile_cols * m.tile_rows;
+
+	// After reading only a window, the image has to be made whole again
+	if (m.area.w != mon.w || m.area.h != mon.h) {
+		for (auto t = begin; t != end; ++t)
+			t->dirty = true;
+	}
+
+	int64_t dirty_area = 0;
+
+	for (auto t = begin; t != end; ++t) {
+		if (t->dirty)
+			dirty_area += t->w * t->h;
+	}
+
+	if (dirty_area == 0)
+		return;
+
+	const int bytes_per_pixel = m.img->bits_per_pixel / 8;
+	const bool hist           = brtUsesHistogram();
+
+	// Past half the monitor, a single transfer is cheaper than many small ones
+	if (dirty_area * 2 > int64_t(mon.w) * mon.h) {
+		fetchArea(mon_idx, { 0, 0, mon.w, mon.h });
+
+		for (auto t = begin; t != end; ++t) {
+			if (!t->dirty)
+				continue;
+			t->brt   = calcRegionBrightness(fmt, reinterpret_cast<uint8_t*>(m.img->data), m.img->bytes_per_line, t->x - mon.x, t->y - mon.y, t->w, t->h, tileStride(*t), hist ? &t->hist : nullptr);
+			t->dirty = false;
+		}
+		return;
+	}
+
+	for (auto t = begin; t != end; ++t) {
+		if (!t->dirty)
+			continue;
+
+		// As in fetchArea, the row length has to match the tile, not the segment
+		tile_img->width          = t->w;
+		tile_img->height         = t->h;
+		tile_img->bytes_per_line = rowBytes(tile_img, t->w);
+
+		XShmGetImage(dsp, default_root_wnd, tile_img, t->x, t->y, AllPlanes);
+
+		t->brt   = calcRegionBrightness(fmt, reinterpret_cast<uint8_t*>(tile_img->data), tile_img->bytes_per_line, 0, 0, t->w, t->h, tileStride(*t), hist ? &t->hist : nullptr);
+		t->dirty = false;
+
+		// Keep the monitor image complete, as if it had been captured in full
+		for (int y = 0; y < t->h; ++y) {
+			memcpy(m.img->data + int64_t(t->y - mon.y + y) * m.img->bytes_per_line + int64_t(t->x - mon.x) * bytes_per_pixel,
+			       tile_img->data + int64_t(y) * tile_img->bytes_per_line,
+			       size_t(t->w) * bytes_per_pixel);
+		}
+	}
+}
+
+int Xshm::tilesBrightness(size_t mon_idx) const noexcept
+{
+	const MonitorImage &m = mon_imgs[mon_idx];
+
+	const auto begin = tiles.begin() + m.tiles_begin;
+	const auto end   = begin + m.tile_cols * m.tile_rows;
+
+	/* Medians and percentiles don't average, so the tile histograms are merged instead.
+	 * Each sample stands for the weighted area of its tile divided by the samples taken there. */
+	if (brtUsesHistogram()) {
+		double bins[256] {};
+
+		for (auto t = begin; t != end; ++t) {
+			const uint64_t n = std::accumulate(t->hist.begin(), t->hist.end(), uint64_t(0));
+			if (n == 0)
+				continue;
+			const double weight = double(t->w) * t->h * t->weight / n;
+			for (int i = 0; i < 256; ++i)
+				bins[i] += t->hist[i] * weight;
+		}
+
+		return brtMetric(bins);
+	}
+
+	int64_t sum  = 0;
+	int64_t area = 0;
+
+	for (auto t = begin; t != end; ++t) {
+		sum  += int64_t(t->brt) * t->w * t->h * t->weight;
+		area += int64_t(t->w) * t->h * t->weight;
+	}
+
+	return area ? int(sum / area) : 0;
+}
+
+// Thumbnail -------------------------------------------------------------
+
+/**
+ * Creates, resizes or drops the thumbnail as the settings change.
+ */
+void Xshm::updateThumbnail()
+{
+	const bool wanted = cfg["brt_downscale"].get<bool>() || cfg["brt_fullscreen"] == "downscale";
+
+	if (!wanted) {
+		destroyThumbnail();
+		return;
+	}
+
+	const int w = std::clamp(cfg["brt_downscale_w"].get<int>(), 1, default_scr->width);
+	const int h = std::clamp(cfg["brt_downscale_h"].get<int>(), 1, default_scr->height);
+
+	if (thumb_img && thumb_img->width == w && thumb_img->height == h)
+		return;
+
+	destroyThumbnail();
+
+	if (!thumb_unavailable)
+		thumb_unavailable = !createThumbnail(w, h);
+}
+
+/**
+ * Lets the server scale the root window down to a thumbnail,
+ * so that only a few kilobytes are transferred per capture.
+ * Returns false if the server can't.
+ */
+bool Xshm::createThumbnail(int w, int h)
+{
+	int ev_base, err_base;
+
+	if (!XRenderQueryExtension(dsp, &ev_base, &err_base)) {
+		LOGW << "XRender unavailable. Capturing at full size.";
+		return false;
+	}
+
+	XRenderPictFormat *fmt = XRenderFindVisualFormat(dsp, default_vis);
+
+	if (!fmt) {
+		LOGW << "No XRender format for the default visual. Capturing at full size.";
+		return false;
+	}
+
+	XRenderPictureAttributes pa {};
+	pa.subwindow_mode = IncludeInferiors;
+	root_pic  = XRenderCreatePicture(dsp, default_root_wnd, fmt, CPSubwindowMode, &pa);
+	thumb_pm  = XCreatePixmap(dsp, default_root_wnd, w, h, default_scr->root_depth);
+	thumb_pic = XRenderCreatePicture(dsp, thumb_pm, fmt, 0, nullptr);
+
+	// The transform maps thumbnail coordinates to root coordinates
+	XTransform xf {{
+		{ XDoubleToFixed(double(default_scr->width) / w), 0, 0 },
+		{ 0, XDoubleToFixed(double(default_scr->height) / h), 0 },
+		{ 0, 0, XDoubleToFixed(1) }
+	}};
+
+	XRenderSetPictureTransform(dsp, root_pic, &xf);
+
+	/* On recent servers, "good" averages the whole source area of each pixel when downscaling.
+	 * On older ones it degrades to bilinear, which still samples more than the full-size stride. */
+	XRenderSetPictureFilter(dsp, root_pic, FilterGood, nullptr, 0);
+
+	thumb_img = createImage(thumb_shminfo, w, h);
+
+	LOGV << "Downscaled capture: " << w << '*' << h;
+
+	return true;
+}
+
+void Xshm::destroyThumbnail()
+{
+	if (!thumb_img)
+		return;
+
+	destroyImage(thumb_img, thumb_shminfo);
+	XRenderFreePicture(dsp, thumb_pic);
+	XRenderFreePicture(dsp, root_pic);
+	XFreePixmap(dsp, thumb_pm);
+
+	thumb_img = nullptr;
+	thumb_pic = root_pic = 0;
+	thumb_pm  = 0;
+}
+
+/**
+ * Each monitor reads the part of the thumbnail it covers (see lastImages).
+ */
+void Xshm::captureThumbnail() noexcept
+{
+	XRenderComposite(dsp, PictOpSrc, root_pic, None, thumb_pic, 0, 0, 0, 0, 0, 0, thumb_img->width, thumb_img->height);
+	XShmGetImage(dsp, thumb_pm, thumb_img, 0, 0, AllPlanes);
+
+	const auto imgs   = lastImages();
+	const Rect active = weightFocus();
+
+	for (size_t i = 0; i < imgs.size(); ++i) {
+		const Image    &img     = imgs[i];
+		const WeightMap weights = monitorWeights(i, active, img.width, img.height);
+
+		if (weights.uniform()) {
+			mon_imgs[i].brt = calcRegionBrightness(img.format, img.data, img.bytes_per_line, 0, 0, img.width, img.height, 1);
+			continue;
+		}
+
+		// A grid with a sample per pixel, grouped by weight
+		Histogram hist {};
+		const SampleGrid &grid = grids.get(img.width, img.height, img.bytes_per_line, img.bytes_per_pixel, img.width * img.height, weights);
+		mon_imgs[i].brt = brtMetric(img.format, grid.sum(img.format, img.data, brtUsesHistogram() ? &hist : nullptr), hist);
+	}
+}
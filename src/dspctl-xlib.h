@@ -8,51 +8,258 @@
 
 #include <X11/Xlib.h>
 #include <X11/extensions/XShm.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xrandr.h>
 #include <cstdint>
 #include <vector>
+#include <string>
+#include <mutex>
+#include <optional>
+#include "capture.h"
+#include "sampler.h"
+#include "weights.h"
+#include "ramp.h"
+
+/**
+ * A monitor as reported by XRandR, in root window coordinates.
+ */
+struct Monitor
+{
+	std::string name;
+	int x, y, w, h;
+	std::vector<RROutput> outputs;
+};
 
 class XLib
 {
 public:
 	XLib();
 	~XLib();
-	int getScreenBrightness() noexcept;
+	std::vector<std::string> monitorNames() const;
 protected:
 	Display *dsp;
 	int scr_count;
 	Window  default_root_wnd;
 	Screen  *default_scr;
 	int     default_scr_num;
+	std::vector<Monitor> monitors;
+	Atom    active_wnd_atom;
+	Atom    wm_state_atom;
+	Atom    fullscreen_atom;
+	void queryMonitors();
+	Window activeWindowId() const;
+	Rect activeWindow() const;
+	bool activeWindowFullscreen() const;
+	Rect weightFocus() const;
+	WeightMap monitorWeights(size_t mon_idx, const Rect &active, int width, int height) const;
 };
 
-class Vidmode : public XLib
+/**
+ * Sets a separate gamma ramp on each active CRTC.
+ */
+class Randr : public XLib
+{
+public:
+	Randr();
+	~Randr();
+	const RampCache& rampCache() const noexcept { return ramps; }
+protected:
+	RampCache ramps;
+	std::mutex gamma_mtx;
+	bool calibrate = true; // Cleared to leave pure gamma on exit
+	bool randrGammaAvailable() const noexcept;
+	void setCrtcsGamma(const std::vector<int> &brt_steps, int temp);
+	void setInitialCrtcsGamma();
+	void forceCrtcsGamma();
+	bool crtcsGammaChanged();
+	bool calibrationReloaded();
+private:
+	struct Crtc
+	{
+		RRCrtc id;
+		size_t monitor;
+		XRRCrtcGamma *ramp;
+		XRRCrtcGamma *init_ramp;
+		CalibrationLut calib;
+		uint64_t uploaded = 0; // Fingerprint of the ramp we sent last, which stays in ramp
+		std::vector<uint16_t> foreign; // Last ramp set by another program, in case it's a calibration
+	};
+	std::vector<Crtc> crtcs;
+	Atom icc_atom      = None;
+	int  randr_ev_base = -1;
+	int  reload_checks = 0; // Read-backs left that may take a replaced ramp as the calibration
+};
+
+/**
+ * Falls back to a single XF86VidMode ramp when per-CRTC gamma is unavailable.
+ */
+class Vidmode : public Randr
 {
 public:
 	Vidmode();
 	~Vidmode();
 	void setGamma(int, int);
+	void setMonitorsGamma(const std::vector<int> &brt_steps, int temp);
 	void setInitialGamma(bool);
+	void forceGamma();
+	bool screenInactive(int idle_timeout_s);
+	bool gammaChanged();
 private:
-	int ramp_sz;
+	bool dpms_available  = false;
+	bool saver_available = false;
+	int ramp_sz = 0;
 	bool initial_ramp_exists = true;
 	std::vector<uint16_t> ramp;
 	std::vector<uint16_t> init_ramp;
-	void fillRamp(const int brightness, const int temp);
+	CalibrationLut calib;
+	uint64_t uploaded = 0;
+	std::vector<uint16_t> foreign;
 };
 
-class Xshm : public Vidmode
+/**
+ * Listens to root window events on a dedicated connection,
+ * so that waiting never races with requests on the main one.
+ */
+class XEvents
+{
+public:
+	enum Event : unsigned
+	{
+		damaged = 1,
+		focused = 2, // The active window or the workspace changed
+		woken   = 4,
+		layout  = 8, // Monitors were added, removed, moved or resized
+		state   = 16 // The active window's _NET_WM_STATE changed, or another window became active
+	};
+
+	XEvents();
+	~XEvents();
+	bool damageAvailable() const noexcept;
+	bool focusAvailable() const noexcept;
+	unsigned wait(int timeout_ms, unsigned events) noexcept;
+	unsigned take(unsigned events) noexcept;
+	void wake() noexcept;
+	const std::vector<XRectangle>& damagedAreas() const noexcept;
+private:
+	Display *dsp = nullptr;
+	Damage  damage = 0;
+	int     damage_ev_base = 0;
+	int     randr_ev_base  = -1;
+	int     wake_fd[2] {-1, -1};
+	Atom    active_wnd_atom = 0;
+	Atom    desktop_atom    = 0;
+	Atom    wm_state_atom   = 0;
+	Window  active_wnd      = None; // Its property changes are selected too
+	unsigned pending = 0; // Events read but not waited for yet
+	XserverRegion damage_region = 0;
+	std::vector<XRectangle> damage_rects;
+	void    readEvents() noexcept;
+	void    fetchDamage() noexcept;
+	void    trackActiveWindow() noexcept;
+};
+
+/**
+ * A rectangle of the screen with its own cached brightness.
+ * Only refreshed when damage intersects it.
+ */
+struct Tile
+{
+	int x, y, w, h;
+	int brt    = 0;
+	int weight = 1;
+	bool dirty = true;
+	Histogram hist {}; // Only filled for metrics other than the mean
+};
+
+/**
+ * Capture state of a monitor. Each one has its own segment and tile grid,
+ * so monitors without damage are skipped entirely.
+ */
+struct MonitorImage
+{
+	XShmSegmentInfo shminfo;
+	XImage *img = nullptr;
+	size_t tiles_begin = 0;
+	int    tile_cols   = 0;
+	int    tile_rows   = 0;
+	int    brt         = 0;
+	Rect   area;       // Part of the monitor the image holds, packed from the start
+	WeightMap weights; // The tiles' weights were computed from these
+};
+
+/**
+ * Plain XGetImage of each monitor. Slower, but needs no extensions.
+ */
+class Ximage : public XLib, public CaptureSource
+{
+public:
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+private:
+	std::optional<PixelFormat> fmt;
+	SampleGrids grids;
+};
+
+class Xshm : public XLib, public CaptureSource
 {
 public:
 	Xshm();
 	~Xshm();
-	int getScreenBrightness() noexcept;
+	std::vector<std::string> monitorNames() const override;
+	std::vector<int> getMonitorsBrightness() override;
+	std::vector<Image> lastImages() const override;
+	bool detectsChanges() const override;
+	bool waitForChange(int timeout_ms) override;
+	bool detectsFocusChanges() const override;
+	bool waitForFocusChange(int timeout_ms) override;
+	void wake() override;
+	bool fullscreen() override;
+	bool useDamage() const noexcept;
+	bool useDownscale() const noexcept;
+	bool useWindowArea() const noexcept;
 private:
-	XShmSegmentInfo shminfo;
-	XImage *shi;
+	XEvents events;
 	Visual *default_vis;
-	XImage* createImage();
+	PixelFormat fmt;
+	SampleGrids grids;
+	std::vector<MonitorImage> mon_imgs;
+	XImage* createImage(XShmSegmentInfo &info, int width, int height);
+	void destroyImage(XImage *img, XShmSegmentInfo &info);
+	void createImages();
+	void destroyImages();
+	void updateLayout();
+	void capture() noexcept;
+	bool captureWindow() noexcept;
+	void fetchArea(size_t mon_idx, const Rect &r) noexcept;
+
+	std::vector<Tile> tiles;
+	XShmSegmentInfo tile_shminfo;
+	XImage *tile_img = nullptr;
+	int tile_sz;
+	bool tile_hists = false;
+	void createTiles();
+	void markDirty(const XRectangle &r) noexcept;
+	void updateTileWeights(size_t mon_idx, const WeightMap &weights) noexcept;
+	void refreshTiles(size_t mon_idx) noexcept;
+	int  tilesBrightness(size_t mon_idx) const noexcept;
+
+	// Server-side downscaling
+	Picture root_pic  = 0;
+	Picture thumb_pic = 0;
+	Pixmap  thumb_pm  = 0;
+	XShmSegmentInfo thumb_shminfo;
+	XImage *thumb_img = nullptr;
+	bool    downscaled = false; // The last capture used the thumbnail
+	bool    active_fullscreen = false; // Refreshed when XEvents reports a state change
+	void updateFullscreen() noexcept;
+	bool    thumb_unavailable = false;
+	bool createThumbnail(int width, int height);
+	void destroyThumbnail();
+	void updateThumbnail();
+	void captureThumbnail() noexcept;
 };
 
-typedef Xshm DspCtl;
+typedef Vidmode DspCtl;
 
 #endif // X11_H
@@ -3,16 +3,20 @@
  * License: https://github.com/Fushko/gammy#license
  */
 
-#include <QTime>
+#include <QDateTime>
 #include <thread>
+#include <algorithm>
 #include "gammactl.h"
 #include "defs.h"
 #include "utils.h"
 #include "cfg.h"
 #include "mediator.h"
 
-GammaCtl::GammaCtl()
+GammaCtl::GammaCtl(std::unique_ptr<Clock> clock) : clock(std::move(clock))
 {
+	if (!this->clock)
+		this->clock = createClock(cfg["clock"]);
+
 	// If auto brightness is on, start at max brightness
 	if (cfg["brt_auto"].get<bool>())
 		cfg["brt_step"] = brt_steps_max;
@@ -21,6 +25,34 @@ GammaCtl::GammaCtl()
 	if (cfg["temp_auto"].get<bool>())
 		cfg["temp_step"] = 0;
 
+	capture = createCaptureSource(cfg["brt_capture"]);
+
+#ifdef _WIN32
+	// DXGI also holds the gamma, so captures go through this same instance
+	if (!capture)
+		capture = std::make_unique<DxgiCapture>(*this);
+#endif
+
+	for (const auto &name : capture->monitorNames()) {
+		BrtCtl c;
+		c.name = name;
+		c.step = cfg["brt_step"];
+		brt_ctls.push_back(c);
+	}
+
+	/* Match the gamma monitors with the captured ones by name.
+	 * Sources that don't know the real names (synthetic) are matched by position. */
+	const auto gamma_monitors = monitorNames();
+
+	for (size_t i = 0; i < gamma_monitors.size(); ++i) {
+		const auto it = std::find_if(brt_ctls.begin(), brt_ctls.end(), [&] (const BrtCtl &c) { return c.name == gamma_monitors[i]; });
+
+		if (it != brt_ctls.end())
+			gamma_map.push_back(int(it - brt_ctls.begin()));
+		else
+			gamma_map.push_back(i < brt_ctls.size() ? int(i) : -1);
+	}
+
 	setGamma(cfg["brt_step"].get<int>(), cfg["temp_step"].get<int>());
 }
 
@@ -31,9 +63,12 @@ void GammaCtl::start()
 	if (!threads.empty())
 		return;
 
-	threads.emplace_back(std::thread([this] { adjustTemperature(); }));
-	threads.emplace_back(std::thread([this] { captureScreen(); }));
-	threads.emplace_back(std::thread([this] { reapplyGamma(); }));
+	// Hold simulated time until every thread is registered
+	clock->addThread();
+	threads.emplace_back(clock->spawn([this] { adjustTemperature(); }));
+	threads.emplace_back(clock->spawn([this] { captureScreen(); }));
+	threads.emplace_back(clock->spawn([this] { reapplyGamma(); }));
+	clock->removeThread();
 }
 
 void GammaCtl::stop()
@@ -55,25 +90,90 @@ void GammaCtl::stop()
 void GammaCtl::notify_temp(bool force)
 {
 	force_temp_change = force;
-	temp_cv.notify_one();
+	clock->notify(temp_cv);
 }
 
 void GammaCtl::notify_ss()
 {
-	ss_cv.notify_one();
+	clock->notify(ss_cv);
+	capture->wake();
+}
+
+/**
+ * Wakes the capture thread, so that it stops or resumes right away.
+ */
+void GammaCtl::notify_locked(bool locked)
+{
+	LOGD << "Session " << (locked ? "locked" : "unlocked");
+	this->locked = locked;
+	notify_ss();
+}
+
+/**
+ * True while nobody is looking: the screen is locked, blanked, covered
+ * by the screen saver, or there was no input for suspend_idle_timeout seconds.
+ */
+bool GammaCtl::suspended()
+{
+	if (!cfg["suspend_inactive"].get<bool>())
+		return false;
+
+	return locked || screenInactive(cfg["suspend_idle_timeout"].get<int>());
 }
 
 void GammaCtl::notify_all_threads()
 {
-	temp_cv.notify_one();
-	ss_cv.notify_one();
-	reapply_cv.notify_one();
+	clock->notify(temp_cv);
+	clock->notify(ss_cv);
+	clock->notify(reapply_cv);
+	capture->wake();
+}
+
+/**
+ * Sets the gamma of every monitor to its current step.
+ * Without auto brightness, they all share the slider step.
+ */
+void GammaCtl::applyGamma()
+{
+	if (cfg["brt_auto"].get<bool>())
+		setMonitorsGamma(brtSteps(), cfg["temp_step"]);
+	else
+		setGamma(cfg["brt_step"], cfg["temp_step"]);
+}
+
+/**
+ * Steps ordered by gamma monitor.
+ */
+std::vector<int> GammaCtl::brtSteps()
+{
+	std::lock_guard lock(brt_mtx);
+
+	std::vector<int> steps;
+	steps.reserve(gamma_map.size());
+
+	for (int ctl : gamma_map)
+		steps.push_back(ctl == -1 ? cfg["brt_step"].get<int>() : brt_ctls[ctl].step);
+
+	return steps;
+}
+
+/**
+ * Monitors can override the global brightness settings by name. For example:
+ * "brt_monitors": { "DP-1": { "brt_min": 200, "brt_offset": 100 } }
+ */
+int GammaCtl::monitorCfg(const BrtCtl &c, const char *key) const
+{
+	const json &overrides = cfg["brt_monitors"];
+	const auto it = overrides.find(c.name);
+
+	if (it != overrides.end() && it->contains(key))
+		return (*it)[key].get<int>();
+
+	return cfg[key].get<int>();
 }
 
 void GammaCtl::reapplyGamma()
 {
-	using namespace std::this_thread;
-	using namespace std::chrono;
 	using namespace std::chrono_literals;
 
 	std::mutex mtx;
@@ -81,7 +181,7 @@ void GammaCtl::reapplyGamma()
 	while (true) {
 		{
 			std::unique_lock<std::mutex> lock(mtx);
-			reapply_cv.wait_until(lock, system_clock::now() + 5s, [&] {
+			clock->waitFor(lock, reapply_cv, 5s, [&] {
 				return quit;
 			});
 		}
@@ -89,32 +189,77 @@ void GammaCtl::reapplyGamma()
 		if (quit)
 			break;
 
-		setGamma(cfg["brt_step"], cfg["temp_step"]);
+		// Only another program changing the ramps calls for sending them again
+		if (!suspended() && gammaChanged())
+			applyGamma();
 	}
 }
 
+/**
+ * Waits for the next capture, at least rate_ms later.
+ * Sources that detect changes (XDamage) then wait for one, up to timeout_ms,
+ * which catches content that doesn't report them. Others wait interval_ms.
+ * Returns true if a focus or workspace change cut the wait short.
+ */
+bool GammaCtl::waitCapture(int rate_ms, int interval_ms, int timeout_ms)
+{
+	const int  polling_ms = cfg["brt_polling_rate"];
+	const bool damage     = capture->detectsChanges() && !clock->simulated();
+	const int  wait_ms    = damage ? rate_ms : std::max(rate_ms, interval_ms);
+	bool       focused    = false;
+
+	/* Focus and workspace changes cut the wait short,
+	 * as they bring most of the large brightness jumps.
+	 * Changes happen in real time, so simulated time only polls.
+	 * On Windows, we sleep polling_ms in getScreenBrightness(). */
+	if constexpr (windows) {
+		if (wait_ms > polling_ms)
+			clock->sleepFor(std::chrono::milliseconds(wait_ms - polling_ms));
+	} else {
+		if (capture->detectsFocusChanges() && !clock->simulated())
+			focused = capture->waitForFocusChange(wait_ms);
+		else
+			clock->sleepFor(std::chrono::milliseconds(wait_ms));
+	}
+
+	// Damage and focus changes end this wait alike
+	if (!focused && damage && !quit)
+		capture->waitForChange(timeout_ms);
+
+	return focused;
+}
+
+/**
+ * Doubles the wait after each capture that finds the screen brightness stable,
+ * from min up to max, and goes back to min once it changes.
+ */
+static int backOff(int wait, bool changed, int min, int max)
+{
+	if (changed || !cfg["brt_polling_adaptive"].get<bool>())
+		return min;
+
+	return std::clamp(wait * 2, min, std::max(min, max));
+}
+
 void GammaCtl::captureScreen()
 {
 	LOGV << "captureScreen() start";
 
 	convar      brt_cv;
-	std::thread brt_thr([&] { adjustBrightness(brt_cv); });
+	std::thread brt_thr = clock->spawn([&] { adjustBrightness(brt_cv); });
 	std::mutex  m;
 
-	int img_delta = 0;
-	bool force    = false;
-
-	int
-	prev_img_br = 0,
-	prev_min    = 0,
-	prev_max    = 0,
-	prev_offset = 0;
+	bool force         = false;
+	bool was_suspended = false;
+	bool was_frozen    = false;
+	int  interval      = cfg["brt_polling_rate"];
+	int  damage_wait   = cfg["brt_damage_timeout"];
 
 	while (true) {
 		{
 			std::unique_lock<std::mutex> lock(m);
 
-			ss_cv.wait(lock, [&] {
+			clock->wait(lock, ss_cv, [&] {
 				return cfg["brt_auto"].get<bool>() || quit;
 			});
 		}
@@ -127,36 +272,115 @@ void GammaCtl::captureScreen()
 		else
 			continue;
 
+		// Every monitor starts from the step set while auto brightness was off
+		{
+			std::lock_guard lock(brt_mtx);
+			for (auto &c : brt_ctls) {
+				c.step      = cfg["brt_step"];
+				c.adjusting = false;
+			}
+		}
+
 		while (cfg["brt_auto"].get<bool>() && !quit) {
 
-			const int img_br = getScreenBrightness();
-			img_delta += abs(prev_img_br - img_br);
+			/* Nothing is captured while nobody is looking.
+			 * The state is checked every second, or as soon as the lock changes. */
+			if (suspended()) {
+				if (!was_suspended) {
+					LOGD << "Suspending capture";
+				}
+				was_suspended = true;
+
+				const bool was_locked = locked;
+				std::unique_lock<std::mutex> lock(m);
+				clock->waitFor(lock, ss_cv, std::chrono::seconds(1), [&] {
+					return quit || !cfg["brt_auto"].get<bool>() || locked != was_locked;
+				});
+				continue;
+			}
+
+			// The screen may have changed entirely meanwhile
+			if (was_suspended) {
+				LOGD << "Resuming capture";
+				was_suspended = false;
+				force         = true;
+				forceGamma();
+				applyGamma();
+			}
+
+			/* A fullscreen video or game gets the memory bandwidth to itself:
+			 * depending on brt_fullscreen, the brightness is frozen or captured less often.
+			 * Sources switch to downscaled captures on their own. */
+			const std::string fs_policy  = cfg["brt_fullscreen"];
+			const bool        fullscreen = (fs_policy == "freeze" || fs_policy == "throttle") && capture->fullscreen();
+
+			if (fullscreen && fs_policy == "freeze") {
+				if (!was_frozen) {
+					LOGD << "Fullscreen window. Freezing brightness.";
+				}
+				was_frozen = true;
+				waitCapture(cfg["brt_fullscreen_polling"], interval, damage_wait);
+				continue;
+			}
+
+			if (was_frozen) {
+				was_frozen = false;
+				force      = true;
+			}
+
+			const std::vector<int> img_br = capture->getMonitorsBrightness();
+			bool notify  = false;
+			bool changed = force;
+
+			for (size_t i = 0; i < brt_ctls.size() && i < img_br.size(); ++i) {
+				BrtCtl &c = brt_ctls[i];
 
-			if (img_delta > cfg["brt_threshold"].get<int>() || force) {
+				const int min    = monitorCfg(c, "brt_min");
+				const int max    = monitorCfg(c, "brt_max");
+				const int offset = monitorCfg(c, "brt_offset");
 
-				img_delta = 0;
-				force = false;
+				c.img_delta += abs(c.prev_img_br - img_br[i]);
 
-				{
-					std::lock_guard lock(brt_mtx);
-					this->ss_brightness = img_br;
-					br_needs_change = true;
+				// A level of difference can come from noise, like a blinking cursor
+				if (abs(c.prev_img_br - img_br[i]) > 1)
+					changed = true;
+
+				if (c.img_delta > monitorCfg(c, "brt_threshold") || force || min != c.prev_min || max != c.prev_max || offset != c.prev_offset) {
+					c.img_delta = 0;
+
+					{
+						std::lock_guard lock(brt_mtx);
+						c.ss_brightness = img_br[i];
+						c.needs_change  = true;
+						br_needs_change = true;
+					}
+
+					notify = true;
 				}
 
-				brt_cv.notify_one();
+				c.prev_img_br = img_br[i];
+				c.prev_min    = min;
+				c.prev_max    = max;
+				c.prev_offset = offset;
 			}
 
-			if (cfg["brt_min"] != prev_min || cfg["brt_max"] != prev_max || cfg["brt_offset"] != prev_offset)
-				force = true;
+			force = false;
+
+			if (notify)
+				clock->notify(brt_cv);
 
-			prev_img_br = img_br;
-			prev_min    = cfg["brt_min"];
-			prev_max    = cfg["brt_max"];
-			prev_offset = cfg["brt_offset"];
+			/* Polling sources back off from brt_polling_rate up to brt_polling_max.
+			 * Sources that detect changes capture as soon as one comes, at most every brt_polling_rate:
+			 * only their fallback backs off, from brt_damage_timeout up to brt_damage_timeout_max. */
+			interval    = backOff(interval, changed, cfg["brt_polling_rate"], cfg["brt_polling_max"]);
+			damage_wait = backOff(damage_wait, changed, cfg["brt_damage_timeout"], cfg["brt_damage_timeout_max"]);
 
-			// On Windows, we sleep in getScreenBrightness()
-			if constexpr (!windows) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(cfg["brt_polling_rate"].get<int>()));
+			const int rate = fullscreen ? cfg["brt_fullscreen_polling"].get<int>() : cfg["brt_polling_rate"].get<int>();
+
+			// Back to the fastest rate, as the new window is likely to change
+			if (waitCapture(rate, interval, damage_wait)) {
+				interval    = cfg["brt_polling_rate"];
+				damage_wait = cfg["brt_damage_timeout"];
 			}
 		}
 	}
@@ -166,61 +390,94 @@ void GammaCtl::captureScreen()
 		br_needs_change = true;
 	}
 
-	brt_cv.notify_one();
+	clock->notify(brt_cv);
 	brt_thr.join();
 }
 
+/**
+ * A single thread animates every monitor. Each one has its own transition,
+ * and all of them are applied together once per frame.
+ */
 void GammaCtl::adjustBrightness(convar &brt_cv)
 {
-	using namespace std::this_thread;
 	using namespace std::chrono;
 
 	while (true) {
-		int img_br;
+		bool adjusting = false;
+		bool changed   = false;
 
 		{
 			std::unique_lock<std::mutex> lock(brt_mtx);
 
-			brt_cv.wait(lock, [&] {
-				return br_needs_change;
+			clock->wait(lock, brt_cv, [&] {
+				return br_needs_change || std::any_of(brt_ctls.begin(), brt_ctls.end(), [] (const BrtCtl &c) { return c.adjusting; });
 			});
 
 			if (quit)
 				break;
 
-			br_needs_change = false;
-			img_br = this->ss_brightness;
-		}
-
-		const int cur_step = cfg["brt_step"];
-		const int tmp = brt_steps_max
-		                - int(remap(img_br, 0, 255, 0, brt_steps_max))
-		                + int(remap(cfg["brt_offset"].get<int>(), 0, brt_steps_max, 0, cfg["brt_max"].get<int>()));
-		const int target_step = std::clamp(tmp, cfg["brt_min"].get<int>(), cfg["brt_max"].get<int>());
-
-		if (cur_step == target_step) {
-			LOGV << "Brt already at target (" << target_step << ')';
-			continue;
-		}
-
-		double time             = 0;
-		const int FPS           = cfg["brt_fps"];
-		const double slice      = 1. / FPS;
-		const double duration_s = cfg["brt_speed"].get<double>() / 1000;
-		const int diff          = target_step - cur_step;
+			if (br_needs_change) {
+				br_needs_change = false;
+
+				for (auto &c : brt_ctls) {
+					if (!c.needs_change)
+						continue;
+
+					c.needs_change = false;
+
+					const int max = monitorCfg(c, "brt_max");
+					const int tmp = brt_steps_max
+					                - int(remap(c.ss_brightness, 0, 255, 0, brt_steps_max))
+					                + int(remap(monitorCfg(c, "brt_offset"), 0, brt_steps_max, 0, max));
+					const int target_step = std::clamp(tmp, monitorCfg(c, "brt_min"), max);
+
+					if (c.step == target_step) {
+						LOGV << "Brt already at target (" << target_step << ") on " << c.name;
+						c.adjusting = false;
+						continue;
+					}
+
+					// A new target restarts the transition from where we are
+					c.start_step  = c.step;
+					c.target_step = target_step;
+					c.time        = 0;
+					c.duration_s  = cfg["brt_speed"].get<double>() / 1000;
+					c.adjusting   = true;
+				}
+			}
 
-		while (cfg["brt_step"].get<int>() != target_step) {
+			if (!cfg["brt_auto"].get<bool>()) {
+				for (auto &c : brt_ctls)
+					c.adjusting = false;
+				continue;
+			}
 
-			if (br_needs_change || !cfg["brt_auto"].get<bool>() || quit)
-				break;
+			const double slice = 1. / cfg["brt_fps"].get<int>();
+			int sum = 0;
+
+			for (auto &c : brt_ctls) {
+				if (c.adjusting) {
+					const int prev = c.step;
+					c.time += slice;
+					c.step = int(std::round(easeOutExpo(c.time, c.start_step, c.target_step - c.start_step, c.duration_s)));
+					c.adjusting = c.step != c.target_step;
+					adjusting |= c.adjusting;
+					changed   |= c.step != prev;
+				}
+				sum += c.step;
+			}
 
-			time += slice;
-			cfg["brt_step"] = int(std::round(easeOutExpo(time, cur_step, diff, duration_s)));
+			// The slider shows the average of all monitors
+			cfg["brt_step"] = brt_ctls.empty() ? brt_steps_max : sum / int(brt_ctls.size());
+		}
 
-			setGamma(cfg["brt_step"], cfg["temp_step"]);
+		if (changed) {
+			applyGamma();
 			mediator->notify(this, BRT_CHANGED);
-			sleep_for(milliseconds(1000 / FPS));
 		}
+
+		if (adjusting)
+			clock->sleepFor(milliseconds(1000 / cfg["brt_fps"].get<int>()));
 	}
 }
 
@@ -233,7 +490,6 @@ void GammaCtl::adjustBrightness(convar &brt_cv)
  */
 void GammaCtl::adjustTemperature()
 {
-	using namespace std::this_thread;
 	using namespace std::chrono;
 	using namespace std::chrono_literals;
 
@@ -266,11 +522,11 @@ void GammaCtl::adjustTemperature()
 	std::mutex clock_mtx;
 	std::mutex temp_mtx;
 
-	std::thread clock ([&] {
+	std::thread clock_thr = clock->spawn([&] {
 		while (true) {
 			{
 				std::unique_lock<std::mutex> lk(clock_mtx);
-				clock_cv.wait_until(lk, system_clock::now() + 60s, [&] {
+				clock->waitFor(lk, clock_cv, 60s, [&] {
 					return quit;
 				});
 			}
@@ -286,17 +542,19 @@ void GammaCtl::adjustTemperature()
 				needs_change = true; // @TODO: Should be false if the state hasn't changed
 			}
 
-			temp_cv.notify_one();
+			clock->notify(temp_cv);
 		}
 	});
 
 	bool first_step_done = false;
 
 	while (true) {
+		bool resend = false;
+
 		{
 			std::unique_lock<std::mutex> lock(temp_mtx);
 
-			temp_cv.wait(lock, [&] {
+			clock->wait(lock, temp_cv, [&] {
 				return needs_change || first_step_done || force_temp_change || quit;
 			});
 
@@ -307,11 +565,18 @@ void GammaCtl::adjustTemperature()
 				updateInterval();
 				force_temp_change = false;
 				first_step_done = false;
+				resend = true;
 			}
 
 			needs_change = false;
 		}
 
+		// After a wake up, the ramps may be gone even if the step stays the same
+		if (resend) {
+			forceGamma();
+			applyGamma();
+		}
+
 		if (!cfg["temp_auto"])
 			continue;
 
@@ -320,7 +585,7 @@ void GammaCtl::adjustTemperature()
 		double duration_s  = 2;               // Seconds it takes to reach it
 
 		const double    adapt_time_s = cfg["temp_speed"].get<double>() * 60;
-		const QDateTime cur_datetime = QDateTime::currentDateTime();
+		const QDateTime cur_datetime = QDateTime::fromMSecsSinceEpoch(duration_cast<milliseconds>(clock->now().time_since_epoch()).count());
 		const QTime     cur_time     = cur_datetime.time();
 
 		if ((cur_time >= start_time) || (cur_time < end_time)) {
@@ -373,14 +638,14 @@ void GammaCtl::adjustTemperature()
 			time += slice;
 			cfg["temp_step"] = int(easeInOutQuad(time, cur_step, diff, duration_s));
 
-			setGamma(cfg["brt_step"], cfg["temp_step"]);
+			applyGamma();
 			mediator->notify(this, TEMP_CHANGED);
-			sleep_for(milliseconds(1000 / FPS));
+			clock->sleepFor(milliseconds(1000 / FPS));
 		}
 
 		first_step_done = true;
 	}
 
-	clock_cv.notify_one();
-	clock.join();
+	clock->notify(clock_cv);
+	clock_thr.join();
 }
@@ -8,6 +8,9 @@
 
 #include <vector>
 #include <thread>
+#include <string>
+#include <memory>
+#include <atomic>
 #include "defs.h"
 
 #ifdef _WIN32
@@ -21,33 +24,75 @@
 #endif
 
 #include "component.h"
+#include "capture.h"
+#include "clock.h"
 
 class GammaCtl : public DspCtl, public Component
 {
 public:
-	GammaCtl();
+	/**
+	 * Without a clock, the one named in cfg["clock"] is used.
+	 */
+	GammaCtl(std::unique_ptr<Clock> clock = nullptr);
 
 	void start();
 	void stop();
+	void applyGamma();
 
 	void notify_ss();
 	void notify_temp(bool force = false);
+	void notify_locked(bool locked);
 private:
+	/**
+	 * Auto brightness state of a single monitor.
+	 * The capture fields are only touched by the capture thread,
+	 * the rest is guarded by brt_mtx.
+	 */
+	struct BrtCtl
+	{
+		std::string name;
+
+		// Capture
+		int prev_img_br = 0;
+		int img_delta   = 0;
+		int prev_min    = 0;
+		int prev_max    = 0;
+		int prev_offset = 0;
+
+		// Adjustment
+		int    ss_brightness = 0;
+		bool   needs_change  = false;
+		int    step          = brt_steps_max;
+		int    start_step    = 0;
+		int    target_step   = 0;
+		double time          = 0;
+		double duration_s    = 0;
+		bool   adjusting     = false;
+	};
+
 	void captureScreen();
 	void adjustBrightness(convar &br_cv);
 	void adjustTemperature();
+	bool waitCapture(int rate_ms, int interval_ms, int timeout_ms);
 	void reapplyGamma();
 	void notify_all_threads();
+	int  monitorCfg(const BrtCtl &c, const char *key) const;
+	bool suspended();
+	std::vector<int> brtSteps();
 
+	std::unique_ptr<Clock> clock;
+	std::unique_ptr<CaptureSource> capture;
 	std::vector<std::thread> threads;
+	std::vector<BrtCtl> brt_ctls;
+	std::vector<int> gamma_map;
 	convar ss_cv;
 	convar temp_cv;
 	convar reapply_cv;
 	std::mutex brt_mtx;
-	int ss_brightness = 0;
 	bool br_needs_change   = false;
 	bool force_temp_change = false;
 	bool quit              = false;
+	std::atomic<bool> locked {false}; // As reported by logind
 };
 
 #endif // GAMMACTL_H
@@ -0,0 +1,734 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "luma.h"
+#include "defs.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LUMA_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__ARM_NEON)
+#define LUMA_NEON
+#include <arm_neon.h>
+#endif
+
+/* The vector kernels handle 32 bit pixels with 8 bit channels.
+ * R, G and B are the byte offsets of each channel within the pixel,
+ * which makes them shifts of 8 * offset in a little endian load. */
+
+static inline uint32_t load32(const uint8_t *p) noexcept
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+// Scalar ----------------------------------------------------------------
+
+template <int R, int G, int B>
+static RgbSums sumScalar(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	RgbSums s;
+
+	for (uint64_t i = 0; i < count; i += stride) {
+		const uint8_t *p = px + i * 4;
+		s.r += p[R];
+		s.g += p[G];
+		s.b += p[B];
+		++s.n;
+	}
+
+	return s;
+}
+
+/**
+ * Continues from the first pixel the vector loop didn't reach.
+ */
+template <int R, int G, int B>
+static RgbSums sumTail(const uint8_t *px, uint64_t count, uint64_t stride, uint64_t i, RgbSums s)
+{
+	if (i < count)
+		s += sumScalar<R, G, B>(px + i * 4, count - i, stride);
+
+	return s;
+}
+
+#ifdef LUMA_X86
+
+// SSE2 ------------------------------------------------------------------
+
+/* Each channel is masked out of the 32 bit lanes, then _mm_sad_epu8 against zero
+ * adds up its bytes into 64 bit lanes, which can't overflow. */
+
+template <int R, int G, int B>
+static inline void accumulate(__m128i v, __m128i &r, __m128i &g, __m128i &b) noexcept
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	r = _mm_add_epi64(r, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi32(v, 8 * R), mask), zero));
+	g = _mm_add_epi64(g, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi32(v, 8 * G), mask), zero));
+	b = _mm_add_epi64(b, _mm_sad_epu8(_mm_and_si128(_mm_srli_epi32(v, 8 * B), mask), zero));
+}
+
+static inline uint64_t hsum(__m128i v) noexcept
+{
+	alignas(16) uint64_t lanes[2];
+	_mm_store_si128(reinterpret_cast<__m128i*>(lanes), v);
+	return lanes[0] + lanes[1];
+}
+
+template <int R, int G, int B>
+static RgbSums sumSSE2(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	__m128i r = _mm_setzero_si128();
+	__m128i g = _mm_setzero_si128();
+	__m128i b = _mm_setzero_si128();
+	uint64_t i = 0;
+
+	if (stride == 1) {
+		for (; i + 4 <= count; i += 4)
+			accumulate<R, G, B>(_mm_loadu_si128(reinterpret_cast<const __m128i*>(px + i * 4)), r, g, b);
+	} else {
+		const uint64_t step = stride * 4;
+		for (; i + 3 * stride < count; i += step) {
+			const uint8_t *p = px + i * 4;
+			accumulate<R, G, B>(_mm_set_epi32(int(load32(p + 3 * stride * 4)), int(load32(p + 2 * stride * 4)), int(load32(p + stride * 4)), int(load32(p))), r, g, b);
+		}
+	}
+
+	RgbSums s;
+	s.r = hsum(r);
+	s.g = hsum(g);
+	s.b = hsum(b);
+	s.n = stride == 1 ? i : i / stride;
+
+	return sumTail<R, G, B>(px, count, stride, i, s);
+}
+
+// AVX2 ------------------------------------------------------------------
+
+template <int R, int G, int B>
+TARGET_AVX2 static inline void accumulate(__m256i v, __m256i &r, __m256i &g, __m256i &b) noexcept
+{
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	const __m256i zero = _mm256_setzero_si256();
+	r = _mm256_add_epi64(r, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi32(v, 8 * R), mask), zero));
+	g = _mm256_add_epi64(g, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi32(v, 8 * G), mask), zero));
+	b = _mm256_add_epi64(b, _mm256_sad_epu8(_mm256_and_si256(_mm256_srli_epi32(v, 8 * B), mask), zero));
+}
+
+TARGET_AVX2 static inline uint64_t hsum(__m256i v) noexcept
+{
+	alignas(32) uint64_t lanes[4];
+	_mm256_store_si256(reinterpret_cast<__m256i*>(lanes), v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+template <int R, int G, int B>
+TARGET_AVX2 static RgbSums sumAVX2(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	__m256i r = _mm256_setzero_si256();
+	__m256i g = _mm256_setzero_si256();
+	__m256i b = _mm256_setzero_si256();
+	uint64_t i = 0;
+
+	if (stride == 1) {
+		for (; i + 8 <= count; i += 8)
+			accumulate<R, G, B>(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(px + i * 4)), r, g, b);
+	} else if (stride * 7 <= uint64_t(INT32_MAX)) {
+		const int s = int(stride);
+		const __m256i idx = _mm256_setr_epi32(0, s, 2 * s, 3 * s, 4 * s, 5 * s, 6 * s, 7 * s);
+		const uint64_t step = stride * 8;
+		for (; i + 7 * stride < count; i += step)
+			accumulate<R, G, B>(_mm256_i32gather_epi32(reinterpret_cast<const int*>(px + i * 4), idx, 4), r, g, b);
+	}
+
+	RgbSums sums;
+	sums.r = hsum(r);
+	sums.g = hsum(g);
+	sums.b = hsum(b);
+	sums.n = stride == 1 ? i : i / stride;
+
+	return sumTail<R, G, B>(px, count, stride, i, sums);
+}
+
+static bool hasAVX2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// The OS must also save the YMM registers
+	__cpuid(info, 1);
+	const bool osxsave = info[2] & (1 << 27);
+	const bool avx     = info[2] & (1 << 28);
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // LUMA_X86
+
+#ifdef LUMA_NEON
+
+// NEON ------------------------------------------------------------------
+
+static inline uint64_t hsum(uint64x2_t v) noexcept
+{
+	return vgetq_lane_u64(v, 0) + vgetq_lane_u64(v, 1);
+}
+
+template <int R, int G, int B>
+static RgbSums sumNEON(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	uint64x2_t r = vdupq_n_u64(0);
+	uint64x2_t g = vdupq_n_u64(0);
+	uint64x2_t b = vdupq_n_u64(0);
+	uint64_t i = 0;
+
+	if (stride == 1) {
+		// vld4 splits 16 pixels into one register per byte
+		for (; i + 16 <= count; i += 16) {
+			const uint8x16x4_t v = vld4q_u8(px + i * 4);
+			r = vpadalq_u32(r, vpaddlq_u16(vpaddlq_u8(v.val[R])));
+			g = vpadalq_u32(g, vpaddlq_u16(vpaddlq_u8(v.val[G])));
+			b = vpadalq_u32(b, vpaddlq_u16(vpaddlq_u8(v.val[B])));
+		}
+	} else {
+		const uint32x4_t mask = vdupq_n_u32(0xff);
+		const uint64_t   step = stride * 4;
+		for (; i + 3 * stride < count; i += step) {
+			const uint8_t *p = px + i * 4;
+			uint32x4_t v = vdupq_n_u32(load32(p));
+			v = vsetq_lane_u32(load32(p + stride * 4), v, 1);
+			v = vsetq_lane_u32(load32(p + 2 * stride * 4), v, 2);
+			v = vsetq_lane_u32(load32(p + 3 * stride * 4), v, 3);
+			r = vpadalq_u32(r, vandq_u32(vshlq_u32(v, vdupq_n_s32(-8 * R)), mask));
+			g = vpadalq_u32(g, vandq_u32(vshlq_u32(v, vdupq_n_s32(-8 * G)), mask));
+			b = vpadalq_u32(b, vandq_u32(vshlq_u32(v, vdupq_n_s32(-8 * B)), mask));
+		}
+	}
+
+	RgbSums s;
+	s.r = hsum(r);
+	s.g = hsum(g);
+	s.b = hsum(b);
+	s.n = stride == 1 ? i : i / stride;
+
+	return sumTail<R, G, B>(px, count, stride, i, s);
+}
+
+#endif // LUMA_NEON
+
+// Dispatch --------------------------------------------------------------
+
+enum class Isa { scalar, sse2, avx2, neon };
+
+static const char* isaName(Isa isa)
+{
+	switch (isa) {
+	case Isa::sse2: return "sse2";
+	case Isa::avx2: return "avx2";
+	case Isa::neon: return "neon";
+	default:        return "scalar";
+	}
+}
+
+static Isa selectIsa()
+{
+	Isa isa = Isa::scalar;
+
+#if defined(LUMA_X86)
+	isa = hasAVX2() ? Isa::avx2 : Isa::sse2;
+#elif defined(LUMA_NEON)
+	// NEON is part of the base instruction set on aarch64
+	isa = Isa::neon;
+#endif
+
+	LOGI << "Luma kernel: " << isaName(isa);
+	return isa;
+}
+
+static Isa isa()
+{
+	static const Isa i = selectIsa();
+	return i;
+}
+
+const char* lumaKernel()
+{
+	return isaName(isa());
+}
+
+/**
+ * 32 bit pixels with 8 bit channels at byte offsets R, G and B.
+ */
+template <int R, int G, int B>
+static RgbSums sumBytes32(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	stride = stride < 1 ? 1 : stride;
+
+	switch (isa()) {
+#if defined(LUMA_X86)
+	case Isa::avx2: return sumAVX2<R, G, B>(px, count, stride);
+	case Isa::sse2: return sumSSE2<R, G, B>(px, count, stride);
+#elif defined(LUMA_NEON)
+	case Isa::neon: return sumNEON<R, G, B>(px, count, stride);
+#endif
+	default:        return sumScalar<R, G, B>(px, count, stride);
+	}
+}
+
+// Layouts ---------------------------------------------------------------
+
+/* Each layout reads the channels of a pixel with read(), and turns them
+ * into an 8 bit luma with luma(). The plain and gathered loops are shared
+ * and instantiated once per layout, with and without a histogram. */
+
+static constexpr int lowBit(uint32_t mask) noexcept
+{
+	int i = 0;
+	while (mask && !(mask & 1)) {
+		mask >>= 1;
+		++i;
+	}
+	return i;
+}
+
+static constexpr int bitCount(uint32_t mask) noexcept
+{
+	int n = 0;
+	for (; mask; mask &= mask - 1)
+		++n;
+	return n;
+}
+
+/**
+ * Rec. 709 weights in 8 bit fixed point: 54 + 183 + 19 = 256.
+ */
+static inline uint32_t luma8(uint32_t r, uint32_t g, uint32_t b) noexcept
+{
+	return (54 * r + 183 * g + 19 * b) >> 8;
+}
+
+/**
+ * Scales a channel of the given depth to 8 bits, repeating the high bits into the low ones.
+ */
+template <int Depth>
+static inline uint32_t to8(uint32_t v) noexcept
+{
+	if constexpr (Depth >= 8)
+		return v >> (Depth - 8);
+	else if constexpr (Depth * 2 >= 8)
+		return (v << (8 - Depth)) | (v >> (2 * Depth - 8));
+	else
+		return v * 255 / ((1u << Depth) - 1);
+}
+
+template <class Px, bool Hist>
+static RgbSums sumLoop(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist)
+{
+	RgbSums s;
+	stride = stride < 1 ? 1 : stride;
+
+	for (uint64_t i = 0; i < count; i += stride) {
+		uint32_t r, g, b;
+		Px::read(fmt, px + i * Px::bytes, r, g, b);
+		s.r += r;
+		s.g += g;
+		s.b += b;
+		if constexpr (Hist)
+			++(*hist)[Px::luma(fmt, r, g, b)];
+	}
+
+	s.n = (count + stride - 1) / stride;
+	return s;
+}
+
+template <class Px, bool Hist>
+static RgbSums gatherLoop(const PixelFormat &fmt, const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist)
+{
+	RgbSums s;
+
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t r, g, b;
+		Px::read(fmt, base + offsets[i], r, g, b);
+		s.r += r;
+		s.g += g;
+		s.b += b;
+		if constexpr (Hist)
+			++(*hist)[Px::luma(fmt, r, g, b)];
+	}
+
+	s.n = n;
+	return s;
+}
+
+/**
+ * Steps through the rectangle by whole rows and a remainder of columns,
+ * so no division is needed per pixel.
+ */
+template <class Px, bool Hist>
+static RgbSums stridedLoop(const PixelFormat &fmt, const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist)
+{
+	RgbSums s;
+
+	if (w <= 0 || h <= 0)
+		return s;
+
+	stride = stride < 1 ? 1 : stride;
+
+	const int64_t dx = int64_t(stride % uint64_t(w));
+	const int64_t dy = int64_t(stride / uint64_t(w));
+
+	for (int64_t cx = 0, cy = 0; cy < h; cx += dx, cy += dy) {
+		if (cx >= w) {
+			cx -= w;
+			if (++cy >= h)
+				break;
+		}
+
+		uint32_t r, g, b;
+		Px::read(fmt, px + cy * bytes_per_line + cx * Px::bytes, r, g, b);
+		s.r += r;
+		s.g += g;
+		s.b += b;
+		++s.n;
+		if constexpr (Hist)
+			++(*hist)[Px::luma(fmt, r, g, b)];
+	}
+
+	return s;
+}
+
+template <class Px>
+static RgbSums sumPixels(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist)
+{
+	return hist ? sumLoop<Px, true>(fmt, px, count, stride, hist) : Px::sum(fmt, px, count, stride);
+}
+
+template <class Px>
+static RgbSums gatherPixels(const PixelFormat &fmt, const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist)
+{
+	return hist ? gatherLoop<Px, true>(fmt, base, offsets, n, hist) : gatherLoop<Px, false>(fmt, base, offsets, n, nullptr);
+}
+
+template <class Px>
+static RgbSums stridedPixels(const PixelFormat &fmt, const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist)
+{
+	return hist ? stridedLoop<Px, true>(fmt, px, bytes_per_line, w, h, stride, hist) : stridedLoop<Px, false>(fmt, px, bytes_per_line, w, h, stride, nullptr);
+}
+
+/**
+ * Reads a pixel of Bytes bytes into a word, in the image byte order.
+ * The loop has a fixed count, so it compiles down to a load (and a swap).
+ */
+template <int Bytes, bool Msb>
+static inline uint32_t readPixel(const uint8_t *p) noexcept
+{
+	uint32_t w = 0;
+	for (int k = 0; k < Bytes; ++k) {
+		if constexpr (Msb)
+			w = (w << 8) | p[k];
+		else
+			w |= uint32_t(p[k]) << (8 * k);
+	}
+	return w;
+}
+
+/**
+ * 32 bit pixels with 8 bit channels at byte offsets R, G and B.
+ * Without a histogram, the vector kernels do the sums.
+ */
+template <int R, int G, int B>
+struct Bytes32
+{
+	static constexpr int bytes = 4;
+
+	static void read(const PixelFormat &, const uint8_t *p, uint32_t &r, uint32_t &g, uint32_t &b) noexcept
+	{
+		r = p[R];
+		g = p[G];
+		b = p[B];
+	}
+
+	static uint32_t luma(const PixelFormat &, uint32_t r, uint32_t g, uint32_t b) noexcept
+	{
+		return luma8(r, g, b);
+	}
+
+	static RgbSums sum(const PixelFormat &, const uint8_t *px, uint64_t count, uint64_t stride)
+	{
+		return sumBytes32<R, G, B>(px, count, stride);
+	}
+};
+
+/**
+ * Channels that aren't whole bytes, like 10 bpc or RGB565. Masks are known at compile time.
+ */
+template <uint32_t RM, uint32_t GM, uint32_t BM, int Bytes, bool Msb>
+struct Packed
+{
+	static constexpr int bytes = Bytes;
+
+	static void read(const PixelFormat &, const uint8_t *p, uint32_t &r, uint32_t &g, uint32_t &b) noexcept
+	{
+		const uint32_t w = readPixel<Bytes, Msb>(p);
+		r = (w & RM) >> lowBit(RM);
+		g = (w & GM) >> lowBit(GM);
+		b = (w & BM) >> lowBit(BM);
+	}
+
+	static uint32_t luma(const PixelFormat &, uint32_t r, uint32_t g, uint32_t b) noexcept
+	{
+		return luma8(to8<bitCount(RM)>(r), to8<bitCount(GM)>(g), to8<bitCount(BM)>(b));
+	}
+
+	static RgbSums sum(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride)
+	{
+		return sumLoop<Packed, false>(fmt, px, count, stride, nullptr);
+	}
+};
+
+/**
+ * Any other layout, with the masks read at run time.
+ */
+template <int Bytes, bool Msb>
+struct Generic
+{
+	static constexpr int bytes = Bytes;
+
+	static void read(const PixelFormat &fmt, const uint8_t *p, uint32_t &r, uint32_t &g, uint32_t &b) noexcept
+	{
+		const uint32_t w = readPixel<Bytes, Msb>(p);
+		r = (w & fmt.masks[0]) >> fmt.shifts[0];
+		g = (w & fmt.masks[1]) >> fmt.shifts[1];
+		b = (w & fmt.masks[2]) >> fmt.shifts[2];
+	}
+
+	static uint32_t luma(const PixelFormat &fmt, uint32_t r, uint32_t g, uint32_t b) noexcept
+	{
+		const auto scale = [&] (uint32_t v, int c) {
+			const uint32_t max = fmt.masks[c] >> fmt.shifts[c];
+			return max ? uint32_t(uint64_t(v) * 255 / max) : 0;
+		};
+		return luma8(scale(r, 0), scale(g, 1), scale(b, 2));
+	}
+
+	static RgbSums sum(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride)
+	{
+		return sumLoop<Generic, false>(fmt, px, count, stride, nullptr);
+	}
+};
+
+RgbSums sumBGRx8(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist)
+{
+	return sumPixels<Bytes32<2, 1, 0>>(fmt, px, count, stride, hist);
+}
+
+RgbSums gatherBGRx8(const PixelFormat &fmt, const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist)
+{
+	return gatherPixels<Bytes32<2, 1, 0>>(fmt, base, offsets, n, hist);
+}
+
+RgbSums stridedBGRx8(const PixelFormat &fmt, const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist)
+{
+	return stridedPixels<Bytes32<2, 1, 0>>(fmt, px, bytes_per_line, w, h, stride, hist);
+}
+
+RgbSums sumBGRx(const uint8_t *px, uint64_t count, uint64_t stride)
+{
+	return sumBytes32<2, 1, 0>(px, count, stride);
+}
+
+// Metrics ---------------------------------------------------------------
+
+Metric metricFromName(const std::string &name)
+{
+	if (name == "median")
+		return Metric::median;
+	if (name == "percentile")
+		return Metric::percentile;
+	if (name == "log_average")
+		return Metric::log_average;
+	if (name != "mean") {
+		LOGW << "Unknown brt_metric: " << name << ". Using mean.";
+	}
+
+	return Metric::mean;
+}
+
+/**
+ * The mean is a plain weighted sum. The log-average is the geometric mean of luma + 1,
+ * which keeps small very bright areas from dominating.
+ */
+int histogramMetric(const double *bins, Metric m, double percentile)
+{
+	double total = 0;
+	for (int i = 0; i < 256; ++i)
+		total += bins[i];
+
+	if (total <= 0)
+		return 0;
+
+	switch (m) {
+	case Metric::mean: {
+		double sum = 0;
+		for (int i = 0; i < 256; ++i)
+			sum += bins[i] * i;
+		return int(sum / total);
+	}
+	case Metric::log_average: {
+		double sum = 0;
+		for (int i = 0; i < 256; ++i)
+			sum += bins[i] * std::log1p(i);
+		return int(std::expm1(sum / total) + 0.5);
+	}
+	case Metric::median:
+		percentile = 50;
+		[[fallthrough]];
+	case Metric::percentile: {
+		const double target = total * std::clamp(percentile, 0., 100.) / 100;
+		double acc = 0;
+		for (int i = 0; i < 256; ++i) {
+			acc += bins[i];
+			if (acc >= target && acc > 0)
+				return i;
+		}
+		return 255;
+	}
+	}
+
+	return 0;
+}
+
+int histogramMetric(const Histogram &h, Metric m, double percentile)
+{
+	double bins[256];
+	for (int i = 0; i < 256; ++i)
+		bins[i] = h[i];
+
+	return histogramMetric(bins, m, percentile);
+}
+
+// PixelFormat -----------------------------------------------------------
+
+double PixelFormat::mean(const RgbSums &s, int ch) const noexcept
+{
+	const uint32_t max = masks[ch] >> shifts[ch];
+
+	if (s.n == 0 || max == 0)
+		return 0;
+
+	const uint64_t sum = ch == 0 ? s.r : ch == 1 ? s.g : s.b;
+
+	return double(sum) * 255 / (double(max) * s.n);
+}
+
+int PixelFormat::luma(const RgbSums &s) const noexcept
+{
+	return int(mean(s, 0) * 0.2126 + mean(s, 1) * 0.7152 + mean(s, 2) * 0.0722);
+}
+
+struct Kernels
+{
+	PixelKernel  sum;
+	PixelGather  gather;
+	PixelStrided strided;
+};
+
+template <class Px>
+static constexpr Kernels kernels()
+{
+	return { sumPixels<Px>, gatherPixels<Px>, stridedPixels<Px> };
+}
+
+template <int Bytes>
+static Kernels genericKernels(bool msb_first)
+{
+	return msb_first ? kernels<Generic<Bytes, true>>() : kernels<Generic<Bytes, false>>();
+}
+
+PixelFormat pixelFormat(int bits_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask, bool msb_first)
+{
+	struct Layout
+	{
+		const char *name;
+		int         bpp;
+		uint32_t    r, g, b;
+		Kernels     lsb;
+		Kernels     msb;
+	};
+
+	static constexpr Layout layouts[] {
+		{ "bgrx8",    32, 0xff0000,   0xff00,  0xff,       kernels<Bytes32<2, 1, 0>>(), kernels<Bytes32<1, 2, 3>>() },
+		{ "rgbx8",    32, 0xff,       0xff00,  0xff0000,   kernels<Bytes32<0, 1, 2>>(), kernels<Bytes32<3, 2, 1>>() },
+		{ "x2rgb10",  32, 0x3ff00000, 0xffc00, 0x3ff,      kernels<Packed<0x3ff00000, 0xffc00, 0x3ff, 4, false>>(), kernels<Packed<0x3ff00000, 0xffc00, 0x3ff, 4, true>>() },
+		{ "x2bgr10",  32, 0x3ff,      0xffc00, 0x3ff00000, kernels<Packed<0x3ff, 0xffc00, 0x3ff00000, 4, false>>(), kernels<Packed<0x3ff, 0xffc00, 0x3ff00000, 4, true>>() },
+		{ "bgr8",     24, 0xff0000,   0xff00,  0xff,       kernels<Packed<0xff0000, 0xff00, 0xff, 3, false>>(), kernels<Packed<0xff0000, 0xff00, 0xff, 3, true>>() },
+		{ "rgb565",   16, 0xf800,     0x7e0,   0x1f,       kernels<Packed<0xf800, 0x7e0, 0x1f, 2, false>>(), kernels<Packed<0xf800, 0x7e0, 0x1f, 2, true>>() },
+		{ "xrgb1555", 16, 0x7c00,     0x3e0,   0x1f,       kernels<Packed<0x7c00, 0x3e0, 0x1f, 2, false>>(), kernels<Packed<0x7c00, 0x3e0, 0x1f, 2, true>>() },
+	};
+
+	PixelFormat fmt;
+	fmt.bytes_per_pixel = bits_per_pixel / 8;
+	fmt.masks[0]        = red_mask;
+	fmt.masks[1]        = green_mask;
+	fmt.masks[2]        = blue_mask;
+	fmt.msb_first       = msb_first;
+
+	for (int c = 0; c < 3; ++c)
+		fmt.shifts[c] = lowBit(fmt.masks[c]);
+
+	const auto use = [&] (const Kernels &k) {
+		fmt.kernel = k.sum;
+		fmt.gather = k.gather;
+		fmt.strided = k.strided;
+	};
+
+	for (const auto &l : layouts) {
+		if (l.bpp == bits_per_pixel && l.r == red_mask && l.g == green_mask && l.b == blue_mask) {
+			fmt.name = l.name;
+			use(msb_first ? l.msb : l.lsb);
+			LOGD << "Pixel format: " << fmt.name << (msb_first ? " (MSB first)" : "");
+			return fmt;
+		}
+	}
+
+	fmt.name = "generic";
+
+	switch (bits_per_pixel) {
+	case 32: use(genericKernels<4>(msb_first)); break;
+	case 24: use(genericKernels<3>(msb_first)); break;
+	case 16: use(genericKernels<2>(msb_first)); break;
+	default:
+		// Indexed visuals would need the colormap
+		LOGE << "Unsupported pixel format: " << bits_per_pixel << " bpp";
+		fmt.bytes_per_pixel = std::max(1, fmt.bytes_per_pixel);
+		use(genericKernels<1>(msb_first));
+		fmt.masks[0] = fmt.masks[1] = fmt.masks[2] = 0;
+		return fmt;
+	}
+
+	LOGW << "Unknown pixel layout, using masks: " << std::hex << red_mask << ' ' << green_mask << ' ' << blue_mask;
+	return fmt;
+}
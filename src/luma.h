@@ -0,0 +1,125 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef LUMA_H
+#define LUMA_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Per channel sums of the sampled pixels, in the depth of their format.
+ */
+struct RgbSums
+{
+	uint64_t r = 0;
+	uint64_t g = 0;
+	uint64_t b = 0;
+	uint64_t n = 0;
+
+	RgbSums& operator+=(const RgbSums &o) noexcept
+	{
+		r += o.r; g += o.g; b += o.b; n += o.n;
+		return *this;
+	}
+};
+
+/**
+ * Counts of the sampled pixels by 8 bit luma.
+ */
+using Histogram = std::array<uint32_t, 256>;
+
+struct PixelFormat;
+
+/**
+ * Sums every stride-th of count pixels, starting from the first.
+ * A stride of 1 reads the whole buffer.
+ * If hist isn't null, the luma of each pixel is also counted, in the same pass.
+ */
+using PixelKernel = RgbSums (*)(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist);
+
+/**
+ * Sums the pixels at the given byte offsets from base.
+ */
+using PixelGather = RgbSums (*)(const PixelFormat &fmt, const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist);
+
+/**
+ * Sums every stride-th pixel of a w * h rectangle whose rows are bytes_per_line apart,
+ * counting in row order from its top left pixel at px.
+ */
+using PixelStrided = RgbSums (*)(const PixelFormat &fmt, const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist);
+
+RgbSums sumBGRx8(const PixelFormat &fmt, const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist);
+RgbSums gatherBGRx8(const PixelFormat &fmt, const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist);
+RgbSums stridedBGRx8(const PixelFormat &fmt, const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist);
+
+/**
+ * Memory layout of a pixel, as described by an XImage.
+ * The kernel is specialized for the layout, so it doesn't branch per pixel.
+ * The default is 8 bit BGRx, which is what DXGI, the synthetic source and traces use.
+ */
+struct PixelFormat
+{
+	const char  *name            = "bgrx8";
+	int          bytes_per_pixel = 4;
+	uint32_t     masks[3]        { 0xff0000, 0xff00, 0xff }; // Red, green, blue
+	int          shifts[3]       { 16, 8, 0 };
+	bool         msb_first       = false;
+	PixelKernel  kernel          = sumBGRx8;
+	PixelGather  gather          = gatherBGRx8;
+	PixelStrided strided         = stridedBGRx8;
+
+	RgbSums sum(const uint8_t *px, uint64_t count, uint64_t stride, Histogram *hist = nullptr) const
+	{
+		return kernel(*this, px, count, stride, hist);
+	}
+
+	RgbSums sumAt(const uint8_t *base, const uint32_t *offsets, size_t n, Histogram *hist = nullptr) const
+	{
+		return gather(*this, base, offsets, n, hist);
+	}
+
+	RgbSums sumRect(const uint8_t *px, int bytes_per_line, int w, int h, uint64_t stride, Histogram *hist = nullptr) const
+	{
+		return strided(*this, px, bytes_per_line, w, h, stride, hist);
+	}
+
+	// Mean of a channel (0: red, 1: green, 2: blue), scaled to 0-255
+	double mean(const RgbSums &s, int ch) const noexcept;
+
+	// Mean luma, scaled to 0-255
+	int luma(const RgbSums &s) const noexcept;
+};
+
+/**
+ * Picks the kernel for a layout. Unknown layouts get a generic one driven by the masks.
+ */
+PixelFormat pixelFormat(int bits_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask, bool msb_first);
+
+/**
+ * How a histogram is reduced to a single brightness value.
+ */
+enum class Metric { mean, median, percentile, log_average };
+
+Metric metricFromName(const std::string &name);
+
+/**
+ * Brightness (0-255) of a histogram. The percentile (0-100) is only used by Metric::percentile.
+ * The double version takes 256 weighted bins.
+ */
+int histogramMetric(const Histogram &h, Metric m, double percentile);
+int histogramMetric(const double *bins, Metric m, double percentile);
+
+/**
+ * Sums 8 bit BGRx pixels.
+ * The kernel (AVX2, SSE2, NEON or scalar) is picked from the CPU on first use.
+ */
+RgbSums sumBGRx(const uint8_t *px, uint64_t count, uint64_t stride);
+
+const char* lumaKernel();
+
+#endif // LUMA_H
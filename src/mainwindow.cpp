@@ -11,6 +11,9 @@
 #include <QMenu>
 #include <QtDBus/QDBusInterface>
 #include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusReply>
+#include <QtDBus/QDBusObjectPath>
+#include <QCoreApplication>
 #include <QShortcut>
 #include "cfg.h"
 #include "mainwindow.h"
@@ -36,6 +39,10 @@ void MainWindow::init()
 		LOGE << "Gammy is unable to reset the proper brightness / temperature when resuming from suspend.";
 	}
 
+	if (!windows && !listenLockSignal()) {
+		LOGW << "Gammy is unable to tell when the session is locked. Capture will continue on the lock screen.";
+	}
+
 	setLabels();
 	setSliders();
 	toggleBrtSliders(cfg["brt_auto"]);
@@ -200,6 +207,78 @@ bool MainWindow::listenWakeupSignal()
 	return true;
 }
 
+/**
+ * logind's LockedHint is set by lock screens, on the session we run in.
+ */
+bool MainWindow::listenLockSignal()
+{
+	QDBusConnection dbus = QDBusConnection::systemBus();
+
+	if (!dbus.isConnected()) {
+		LOGE << "Cannot connect to the system D-Bus.";
+		return false;
+	}
+
+	const QString service = "org.freedesktop.login1";
+
+	QDBusInterface manager(service, "/org/freedesktop/login1", "org.freedesktop.login1.Manager", dbus, this);
+
+	if (!manager.isValid()) {
+		LOGE << "Session manager interface not found.";
+		return false;
+	}
+
+	// Processes outside of a session (like user services) ask for the session of the display instead
+	QDBusReply<QDBusObjectPath> reply = manager.call("GetSessionByPID", uint(QCoreApplication::applicationPid()));
+
+	if (!reply.isValid())
+		reply = manager.call("GetSession", "auto");
+
+	if (!reply.isValid()) {
+		LOGE << "Session not found: " << reply.error().message().toStdString();
+		return false;
+	}
+
+	session_path = reply.value().path();
+
+	bool connected = dbus.connect(service, session_path, "org.freedesktop.DBus.Properties", "PropertiesChanged",
+	                              this, SLOT(sessionPropertiesSlot(QString, QVariantMap, QStringList)));
+
+	if (!connected) {
+		LOGE << "Cannot connect to session signals.";
+		return false;
+	}
+
+	LOGV << "Listening to lock state of " << session_path.toStdString();
+
+	// We may be starting on the lock screen, which the signal won't tell
+	QDBusInterface session(service, session_path, "org.freedesktop.login1.Session", dbus);
+
+	if (session.property("LockedHint").toBool())
+		mediator->notify(this, SESSION_LOCKED);
+
+	return true;
+}
+
+void MainWindow::sessionPropertiesSlot(const QString &interface, const QVariantMap &changed, const QStringList &invalidated)
+{
+	if (interface != "org.freedesktop.login1.Session")
+		return;
+
+	bool locked;
+
+	if (changed.contains("LockedHint")) {
+		locked = changed["LockedHint"].toBool();
+	} else if (invalidated.contains("LockedHint")) {
+		QDBusInterface session("org.freedesktop.login1", session_path, interface, QDBusConnection::systemBus());
+		locked = session.property("LockedHint").toBool();
+	} else {
+		return;
+	}
+
+	mediator->notify(this, locked ? SESSION_LOCKED : SESSION_UNLOCKED);
+}
+
 void MainWindow::wakeupSlot(bool status)
 {
 	// The signal emits TRUE when going to sleep. We only care about wakeup (FALSE)
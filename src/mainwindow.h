@@ -56,12 +56,15 @@ private slots:
 
 	void on_advBrSettingsBtn_toggled(bool checked);
 	void wakeupSlot(bool);
+	void sessionPropertiesSlot(const QString &interface, const QVariantMap &changed, const QStringList &invalidated);
 private:
 	Ui::MainWindow  *ui;
 	QSystemTrayIcon *tray_icon;
 	QMenu *createTrayMenu();
 
 	bool listenWakeupSignal();
+	bool listenLockSignal();
+	QString session_path;
 	void setWindowProperties(QIcon &icon);
 	void setLabels();
 	void setSliders();
@@ -27,7 +27,7 @@ void Mediator::notify([[maybe_unused]] Component *sender, Component::Event e) co
 		wnd->setTempSlider(cfg["temp_step"]);
 		break;
 	case Component::GAMMA_STEP_CHANGED:
-		gammactl->setGamma(cfg["brt_step"], cfg["temp_step"]);
+		gammactl->applyGamma();
 		break;
 	case Component::AUTO_BRT_TOGGLED:
 		gammactl->notify_ss();
@@ -39,6 +39,12 @@ void Mediator::notify([[maybe_unused]] Component *sender, Component::Event e) co
 		LOGD << "System woke up from sleep";
 		gammactl->notify_temp(true);
 		break;
+	case Component::SESSION_LOCKED:
+		gammactl->notify_locked(true);
+		break;
+	case Component::SESSION_UNLOCKED:
+		gammactl->notify_locked(false);
+		break;
 	case Component::APP_QUIT:
 		gammactl->stop();
 		gammactl->setInitialGamma(true);
@@ -0,0 +1,301 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "ramp.h"
+#include "utils.h"
+#include "cfg.h"
+#include "defs.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAMP_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#define RAMP_NEON
+#include <arm_neon.h>
+#endif
+
+const std::array<double, 3>& tempMultipliers(int temp_step)
+{
+	return temp_multipliers[std::clamp(temp_step, 0, temp_steps_max)];
+}
+
+/* The vector versions do the same double multiplications and truncations
+ * as the scalar one, lane by lane, so their output is identical.
+ * Clamping before truncating gives the same result as clamping after. */
+
+static void fillScalar(uint16_t *r, uint16_t *g, uint16_t *b, int begin, int end, double brt_mult, const std::array<double, 3> &mult)
+{
+	for (int i = begin; i < end; ++i) {
+		const int val = std::clamp(int(i * brt_mult), 0, UINT16_MAX);
+		r[i] = uint16_t(val * mult[0]);
+		g[i] = uint16_t(val * mult[1]);
+		b[i] = uint16_t(val * mult[2]);
+	}
+}
+
+#ifdef RAMP_SSE2
+
+/**
+ * Four int32 lanes in 0-65535 to uint16. The signed saturating pack
+ * needs them shifted into the int16 range first.
+ */
+static inline __m128i packU16(__m128i lo, __m128i hi) noexcept
+{
+	const __m128i bias = _mm_set1_epi32(0x8000);
+	const __m128i v    = _mm_packs_epi32(_mm_sub_epi32(_mm_unpacklo_epi64(lo, hi), bias), _mm_setzero_si128());
+	return _mm_xor_si128(v, _mm_set1_epi16(int16_t(0x8000)));
+}
+
+static int fillSSE2(uint16_t *r, uint16_t *g, uint16_t *b, int n, double brt_mult, const std::array<double, 3> &mult)
+{
+	const __m128d bm   = _mm_set1_pd(brt_mult);
+	const __m128d lo   = _mm_setzero_pd();
+	const __m128d hi   = _mm_set1_pd(UINT16_MAX);
+	const __m128d two  = _mm_set1_pd(2);
+	const __m128d m[3] { _mm_set1_pd(mult[0]), _mm_set1_pd(mult[1]), _mm_set1_pd(mult[2]) };
+	uint16_t *out[3]   { r, g, b };
+
+	__m128d idx = _mm_set_pd(1, 0);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128d idx2 = _mm_add_pd(idx, two);
+
+		// Whole numbers, as int() would leave them
+		const __m128d v0 = _mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(_mm_mul_pd(idx, bm), lo), hi)));
+		const __m128d v1 = _mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(_mm_mul_pd(idx2, bm), lo), hi)));
+
+		for (int ch = 0; ch < 3; ++ch) {
+			const __m128i px = packU16(_mm_cvttpd_epi32(_mm_mul_pd(v0, m[ch])), _mm_cvttpd_epi32(_mm_mul_pd(v1, m[ch])));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(out[ch] + i), px);
+		}
+
+		idx = _mm_add_pd(idx2, two);
+	}
+
+	return i;
+}
+
+#endif // RAMP_SSE2
+
+#ifdef RAMP_NEON
+
+static int fillNEON(uint16_t *r, uint16_t *g, uint16_t *b, int n, double brt_mult, const std::array<double, 3> &mult)
+{
+	const float64x2_t bm   = vdupq_n_f64(brt_mult);
+	const float64x2_t lo   = vdupq_n_f64(0);
+	const float64x2_t hi   = vdupq_n_f64(UINT16_MAX);
+	const float64x2_t two  = vdupq_n_f64(2);
+	const float64x2_t m[3] { vdupq_n_f64(mult[0]), vdupq_n_f64(mult[1]), vdupq_n_f64(mult[2]) };
+	uint16_t *out[3]       { r, g, b };
+
+	const double first[2] { 0, 1 };
+	float64x2_t idx = vld1q_f64(first);
+	int i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		const float64x2_t idx2 = vaddq_f64(idx, two);
+
+		// vrndq truncates like int() does
+		const float64x2_t v0 = vrndq_f64(vminq_f64(vmaxq_f64(vmulq_f64(idx, bm), lo), hi));
+		const float64x2_t v1 = vrndq_f64(vminq_f64(vmaxq_f64(vmulq_f64(idx2, bm), lo), hi));
+
+		for (int ch = 0; ch < 3; ++ch) {
+			const uint32x4_t px = vcombine_u32(vmovn_u64(vcvtq_u64_f64(vmulq_f64(v0, m[ch]))),
+			                                   vmovn_u64(vcvtq_u64_f64(vmulq_f64(v1, m[ch]))));
+			vst1_u16(out[ch] + i, vmovn_u32(px));
+		}
+
+		idx = vaddq_f64(idx2, two);
+	}
+
+	return i;
+}
+
+#endif // RAMP_NEON
+
+void fillRamp(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step)
+{
+	const auto &mult = tempMultipliers(temp_step);
+
+	const int    ramp_mult = (UINT16_MAX + 1) / ramp_sz;
+	const double brt_mult  = normalize(brt_step, 0, brt_steps_max) * ramp_mult;
+
+	int i = 0;
+
+#if defined(RAMP_SSE2)
+	i = fillSSE2(r, g, b, ramp_sz, brt_mult, mult);
+#elif defined(RAMP_NEON)
+	i = fillNEON(r, g, b, ramp_sz, brt_mult, mult);
+#endif
+
+	fillScalar(r, g, b, i, ramp_sz, brt_mult, mult);
+}
+
+void fillRampScalar(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step)
+{
+	const int    ramp_mult = (UINT16_MAX + 1) / ramp_sz;
+	const double brt_mult  = normalize(brt_step, 0, brt_steps_max) * ramp_mult;
+
+	fillScalar(r, g, b, 0, ramp_sz, brt_mult, tempMultipliers(temp_step));
+}
+
+uint64_t rampHash(const uint16_t *ramp, size_t n, uint64_t seed) noexcept
+{
+	// FNV-1a over whole entries
+	uint64_t h = seed ^ 0xcbf29ce484222325;
+
+	for (size_t i = 0; i < n; ++i)
+		h = (h ^ ramp[i]) * 0x100000001b3;
+
+	return h;
+}
+
+bool rampsMatch(const uint16_t *sent, const uint16_t *read, size_t n, int tolerance) noexcept
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (std::abs(int(sent[i]) - int(read[i])) > tolerance)
+			return false;
+	}
+
+	return true;
+}
+
+// RampCache -------------------------------------------------------------
+
+void RampCache::fill(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step)
+{
+	const size_t capacity = size_t(std::max(0, cfg["gamma_ramp_cache"].get<int>()));
+	const size_t n        = size_t(ramp_sz);
+
+	if (capacity == 0) {
+		++miss_count;
+		return fillRamp(r, g, b, ramp_sz, brt_step, temp_step);
+	}
+
+	const uint64_t key = uint64_t(ramp_sz) << 32 | uint64_t(uint16_t(brt_step)) << 16 | uint16_t(temp_step);
+
+	std::lock_guard lock(mtx);
+
+	auto it = entries.find(key);
+
+	if (it != entries.end()) {
+		++hit_count;
+	} else {
+		++miss_count;
+
+		while (entries.size() >= capacity) {
+			entries.erase(std::min_element(entries.begin(), entries.end(), [] (const auto &a, const auto &b) {
+				return a.second.last_use < b.second.last_use;
+			}));
+		}
+
+		Entry e;
+		e.ramp.resize(3 * n);
+		fillRamp(&e.ramp[0], &e.ramp[n], &e.ramp[2 * n], ramp_sz, brt_step, temp_step);
+		it = entries.emplace(key, std::move(e)).first;
+	}
+
+	it->second.last_use = ++tick;
+
+	const uint16_t *ramp = it->second.ramp.data();
+	memcpy(r, ramp,         n * sizeof(uint16_t));
+	memcpy(g, ramp + n,     n * sizeof(uint16_t));
+	memcpy(b, ramp + 2 * n, n * sizeof(uint16_t));
+}
+
+uint64_t RampCache::hits() const noexcept
+{
+	return hit_count;
+}
+
+uint64_t RampCache::misses() const noexcept
+{
+	return miss_count;
+}
+
+// CalibrationLut --------------------------------------------------------
+
+/**
+ * Linear within a step, whether entries span 0 to 65535 or 0 to 65536 - 65536 / n.
+ */
+static bool linearRamp(const uint16_t *ramp, size_t n) noexcept
+{
+	const double tolerance = double(UINT16_MAX + 1) / n + 1;
+
+	for (size_t i = 0; i < n; ++i) {
+		if (std::abs(ramp[i] - double(i) * UINT16_MAX / (n - 1)) > tolerance)
+			return false;
+	}
+
+	return true;
+}
+
+bool linearRamps(const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n) noexcept
+{
+	return n < 2 || (linearRamp(r, n) && linearRamp(g, n) && linearRamp(b, n));
+}
+
+/**
+ * Returns true if the table was rebuilt.
+ */
+bool CalibrationLut::set(const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n)
+{
+	const uint64_t h = n > 1 ? rampHash(b, n, rampHash(g, n, rampHash(r, n))) : 0;
+
+	if (h == hash)
+		return false;
+
+	hash = h;
+	lut.clear();
+
+	if (linearRamps(r, g, b, n))
+		return true;
+
+	constexpr size_t sz = size_t(1) << bits;
+	const uint16_t *src[3] { r, g, b };
+
+	lut.resize(3 * sz);
+
+	// Positions follow fillRamp, where entry i of a pure ramp holds i * 65536 / n
+	for (size_t ch = 0; ch < 3; ++ch) {
+		for (size_t k = 0; k < sz; ++k) {
+			const double pos  = std::min(double(k << (16 - bits)) * n / (UINT16_MAX + 1), double(n - 1));
+			const size_t i    = std::min(size_t(pos), n - 2);
+			const double frac = pos - i;
+
+			lut[ch * sz + k] = uint16_t(std::lround((1 - frac) * src[ch][i] + frac * src[ch][i + 1]));
+		}
+	}
+
+	return true;
+}
+
+bool CalibrationLut::identity() const noexcept
+{
+	return lut.empty();
+}
+
+void CalibrationLut::apply(uint16_t *r, uint16_t *g, uint16_t *b, size_t n) const noexcept
+{
+	if (lut.empty())
+		return;
+
+	constexpr size_t sz    = size_t(1) << bits;
+	constexpr int    shift = 16 - bits;
+
+	const uint16_t *lr = &lut[0],
+	               *lg = &lut[sz],
+	               *lb = &lut[2 * sz];
+
+	for (size_t i = 0; i < n; ++i) {
+		r[i] = lr[r[i] >> shift];
+		g[i] = lg[g[i] >> shift];
+		b[i] = lb[b[i] >> shift];
+	}
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef RAMP_H
+#define RAMP_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Red, green and blue multipliers of a temperature step.
+ */
+const std::array<double, 3>& tempMultipliers(int temp_step);
+
+/**
+ * The ramp multiplier equals 32 when ramp_sz = 2048, 64 when 1024, etc.
+ * Assuming ramp_sz = 2048 and pure state (default brightness/temp)
+ * the RGB channels look like:
+ * [ 0, 32, 64, 96, ... UINT16_MAX - 32 ]
+ */
+void fillRamp(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step);
+
+/**
+ * Same as fillRamp, without SIMD. The reference the vector versions are tested against.
+ */
+void fillRampScalar(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step);
+
+/**
+ * Fingerprint of a ramp channel. Chain the channels through the seed.
+ */
+uint64_t rampHash(const uint16_t *ramp, size_t n, uint64_t seed = 0) noexcept;
+
+/**
+ * Drivers store ramps at their own precision, often 8 or 10 bits,
+ * so a ramp read back only matches the one sent within a step of 8 bits.
+ */
+constexpr int ramp_readback_tolerance = (UINT16_MAX + 1) >> 8;
+
+bool rampsMatch(const uint16_t *sent, const uint16_t *read, size_t n, int tolerance = ramp_readback_tolerance) noexcept;
+
+/**
+ * True if all three channels are linear, which is no calibration at all.
+ */
+bool linearRamps(const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n) noexcept;
+
+/**
+ * Ready-made ramps by size and steps. Transitions going back and forth
+ * and the periodic reapplication only copy them.
+ * Holds up to gamma_ramp_cache ramps, dropping the least recently used.
+ */
+class RampCache
+{
+public:
+	void fill(uint16_t *r, uint16_t *g, uint16_t *b, int ramp_sz, int brt_step, int temp_step);
+	uint64_t hits() const noexcept;
+	uint64_t misses() const noexcept;
+private:
+	struct Entry
+	{
+		std::vector<uint16_t> ramp; // Red, green, then blue
+		uint64_t last_use;
+	};
+	std::mutex mtx;
+	std::unordered_map<uint64_t, Entry> entries;
+	uint64_t tick = 0;
+	std::atomic<uint64_t> hit_count  {0};
+	std::atomic<uint64_t> miss_count {0};
+};
+
+/**
+ * Maps ramp values through the calibration ramp found at startup
+ * (e.g. loaded from an ICC profile), so brightness and temperature
+ * apply on top of it. The table is indexed by the top bits of each value
+ * and is only rebuilt when set() is given a different calibration.
+ */
+class CalibrationLut
+{
+public:
+	static constexpr int bits = 12;
+
+	bool set(const uint16_t *r, const uint16_t *g, const uint16_t *b, size_t n);
+	bool identity() const noexcept;
+	void apply(uint16_t *r, uint16_t *g, uint16_t *b, size_t n) const noexcept;
+private:
+	std::vector<uint16_t> lut; // Red, green, then blue. Empty if identity.
+	uint64_t hash = 0;
+};
+
+#endif // RAMP_H
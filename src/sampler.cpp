@@ -0,0 +1,160 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include <cmath>
+#include "sampler.h"
+#include "utils.h"
+#include "cfg.h"
+#include "defs.h"
+
+// SampleGrid ------------------------------------------------------------
+
+/**
+ * splitmix64. The same cell always gets the same spot,
+ * so a still screen reads the same value every time.
+ */
+static uint64_t hash(uint64_t x) noexcept
+{
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+SampleGrid::SampleGrid(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights)
+    : width(width), height(height), bytes_per_line(bytes_per_line), bytes_per_pixel(bytes_per_pixel), samples(samples), weights(weights)
+{
+	if (width <= 0 || height <= 0 || samples <= 0)
+		return;
+
+	// Cells as close to square as the budget allows
+	const int cols = std::clamp(int(std::lround(std::sqrt(double(samples) * width / height))), 1, width);
+	const int rows = std::clamp(samples / cols, 1, height);
+
+	// Weight in the high half, offset in the low one, so that sorting groups them by weight
+	const auto sampleKeys = [&] (bool weighted) {
+		std::vector<uint64_t> keys;
+		keys.reserve(size_t(cols) * rows);
+
+		for (int cy = 0; cy < rows; ++cy) {
+			const int y0 = int(int64_t(cy) * height / rows);
+			const int y1 = int(int64_t(cy + 1) * height / rows);
+
+			for (int cx = 0; cx < cols; ++cx) {
+				const int x0 = int(int64_t(cx) * width / cols);
+				const int x1 = int(int64_t(cx + 1) * width / cols);
+
+				const uint64_t h = hash(uint64_t(cy) * cols + cx);
+				const int x = x0 + int((h & 0xffffffff) % uint64_t(x1 - x0));
+				const int y = y0 + int((h >> 32) % uint64_t(y1 - y0));
+
+				const uint64_t weight = uint64_t(weighted ? weights.at(x, y) : 1);
+
+				// Samples that don't count aren't read at all
+				if (weight > 0)
+					keys.push_back(weight << 32 | uint32_t(int64_t(y) * bytes_per_line + int64_t(x) * bytes_per_pixel));
+			}
+		}
+
+		return keys;
+	};
+
+	std::vector<uint64_t> keys = sampleKeys(!weights.uniform());
+
+	// Otherwise the brightness would read as 0
+	if (keys.empty()) {
+		LOGW << "Brightness weights are 0 on every sample. Ignoring them.";
+		keys = sampleKeys(false);
+	}
+
+	std::sort(keys.begin(), keys.end());
+
+	offsets.reserve(keys.size());
+
+	for (size_t i = 0; i < keys.size(); ++i) {
+		const uint32_t weight = uint32_t(keys[i] >> 32);
+
+		if (levels.empty() || levels.back().weight != weight)
+			levels.push_back({ weight, i, i });
+
+		++levels.back().end;
+		offsets.push_back(uint32_t(keys[i]));
+	}
+
+	LOGV << "Sample grid: " << cols << '*' << rows << " on " << width << '*' << height << ", " << levels.size() << " weight levels";
+}
+
+bool SampleGrid::matches(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights) const noexcept
+{
+	return this->width == width && this->height == height && this->bytes_per_line == bytes_per_line
+	    && this->bytes_per_pixel == bytes_per_pixel && this->samples == samples && this->weights == weights;
+}
+
+/**
+ * Weighted sums count each sample as many times as its weight,
+ * so the mean and the histogram metrics work on them unchanged.
+ */
+RgbSums SampleGrid::sum(const PixelFormat &fmt, const uint8_t *buf, Histogram *hist) const
+{
+	if (levels.size() <= 1 && (levels.empty() || levels[0].weight == 1))
+		return fmt.sumAt(buf, offsets.data(), offsets.size(), hist);
+
+	RgbSums   s;
+	Histogram level_hist;
+
+	for (const auto &l : levels) {
+		if (hist)
+			level_hist.fill(0);
+
+		const RgbSums ls = fmt.sumAt(buf, offsets.data() + l.begin, l.end - l.begin, hist ? &level_hist : nullptr);
+
+		s.r += ls.r * l.weight;
+		s.g += ls.g * l.weight;
+		s.b += ls.b * l.weight;
+		s.n += ls.n * l.weight;
+
+		if (hist) {
+			for (size_t i = 0; i < hist->size(); ++i)
+				(*hist)[i] += level_hist[i] * l.weight;
+		}
+	}
+
+	return s;
+}
+
+size_t SampleGrid::size() const noexcept
+{
+	return offsets.size();
+}
+
+// SampleGrids -----------------------------------------------------------
+
+const SampleGrid& SampleGrids::get(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights)
+{
+	for (const auto &g : grids) {
+		if (g.matches(width, height, bytes_per_line, bytes_per_pixel, samples, weights))
+			return g;
+	}
+
+	// Old geometries pile up when the budget, the monitors or the focused window change
+	if (grids.size() >= 16)
+		grids.clear();
+
+	return grids.emplace_back(width, height, bytes_per_line, bytes_per_pixel, samples, weights);
+}
+
+int calcSampledBrightness(SampleGrids &grids, const PixelFormat &fmt, const uint8_t *buf, int width, int height, int bytes_per_line, const WeightMap &weights)
+{
+	const int samples = cfg["brt_samples"];
+
+	if (samples <= 0)
+		return calcImageBrightness(fmt, buf, width, height, bytes_per_line, cfg["brt_sample_stride"]);
+
+	Histogram hist {};
+	const SampleGrid &grid = grids.get(width, height, bytes_per_line, fmt.bytes_per_pixel, samples, weights);
+
+	return brtMetric(fmt, grid.sum(fmt, buf, brtUsesHistogram() ? &hist : nullptr), hist);
+}
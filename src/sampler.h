@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <vector>
+#include "luma.h"
+#include "weights.h"
+
+/**
+ * Sample positions spread over an image: the image is split in a grid
+ * with about as many cells as samples, and each cell gets one sample
+ * at a fixed pseudo-random spot inside it.
+ * Unlike a linear stride, this follows the rows and can't line up with
+ * vertical patterns. Positions are byte offsets, sorted in memory order.
+ * With weights, the positions are grouped by weight: each group is summed
+ * by the plain kernel, then scaled by its weight.
+ */
+class SampleGrid
+{
+public:
+	SampleGrid(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights = {});
+	bool    matches(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights) const noexcept;
+	RgbSums sum(const PixelFormat &fmt, const uint8_t *buf, Histogram *hist = nullptr) const;
+	size_t  size() const noexcept;
+private:
+	int width;
+	int height;
+	int bytes_per_line;
+	int bytes_per_pixel;
+	int samples;
+	WeightMap weights;
+	std::vector<uint32_t> offsets;
+
+	// Range of offsets sharing a weight
+	struct Level
+	{
+		uint32_t weight;
+		size_t   begin, end;
+	};
+	std::vector<Level> levels;
+};
+
+/**
+ * The grids of the few geometries a source captures, built on first use.
+ */
+class SampleGrids
+{
+public:
+	// The reference is valid until the next call
+	const SampleGrid& get(int width, int height, int bytes_per_line, int bytes_per_pixel, int samples, const WeightMap &weights = {});
+private:
+	std::vector<SampleGrid> grids;
+};
+
+/**
+ * Brightness of a whole image, sampled on a grid of brt_samples positions,
+ * reduced with brt_metric.
+ * If brt_samples is 0, every brt_sample_stride pixels are read instead, without weights.
+ */
+int calcSampledBrightness(SampleGrids &grids, const PixelFormat &fmt, const uint8_t *buf, int width, int height, int bytes_per_line, const WeightMap &weights = {});
+
+#endif // SAMPLER_H
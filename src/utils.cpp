@@ -7,12 +7,171 @@
 #include <Windows.h>
 #endif
 
+#include <algorithm>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
 #include "utils.h"
+#include "luma.h"
+#include "workers.h"
 #include "cfg.h"
 #include "defs.h"
 
+/**
+ * brt_metric is read for every tile of every capture, so its name is
+ * parsed again (and warned about) only when the setting changes.
+ */
+static Metric brtMetricSetting()
+{
+	static std::mutex  mtx;
+	static std::string name;
+	static Metric      metric = Metric::mean;
+
+	std::lock_guard lock(mtx);
+
+	const auto cur = cfg["brt_metric"].get<std::string>();
+
+	if (cur != name) {
+		name   = cur;
+		metric = metricFromName(name);
+	}
+
+	return metric;
+}
+
+bool brtUsesHistogram()
+{
+	return brtMetricSetting() != Metric::mean;
+}
+
+/**
+ * The mean comes from the channel sums, the other metrics from the histogram.
+ */
+int brtMetric(const PixelFormat &fmt, const RgbSums &s, const Histogram &hist)
+{
+	const Metric m = brtMetricSetting();
+
+	if (m == Metric::mean)
+		return fmt.luma(s);
+
+	return histogramMetric(hist, m, cfg["brt_percentile"].get<double>());
+}
+
+int brtMetric(const double *bins)
+{
+	return histogramMetric(bins, brtMetricSetting(), cfg["brt_percentile"].get<double>());
+}
+
+/**
+ * The histogram to fill: the caller's, or a local one if the metric needs it.
+ */
+static Histogram* useHistogram(Histogram *hist, Histogram &local)
+{
+	Histogram *h = hist ? hist : brtUsesHistogram() ? &local : nullptr;
+
+	if (h)
+		h->fill(0);
+
+	return h;
+}
+
+/**
+ * Runs part(i, hist) for each part on the worker pool and merges the results.
+ * Every part gets its own histogram.
+ */
+template <class F>
+static RgbSums reduceParts(size_t parts, Histogram *hist, F &&part)
+{
+	std::vector<RgbSums>   sums(parts);
+	std::vector<Histogram> hists(hist ? parts : 0);
+
+	workers().run(parts, [&] (size_t i) {
+		sums[i] = part(i, hist ? &hists[i] : nullptr);
+	});
+
+	RgbSums s;
+
+	for (size_t i = 0; i < parts; ++i) {
+		s += sums[i];
+		if (hist) {
+			for (size_t b = 0; b < hist->size(); ++b)
+				(*hist)[b] += hists[i][b];
+		}
+	}
+
+	return s;
+}
+
+/**
+ * Large reductions are split across the worker pool, small ones stay on this thread.
+ */
+static bool parallel(uint64_t samples)
+{
+	const int64_t min = cfg["brt_parallel_min"];
+	return min > 0 && samples >= uint64_t(min);
+}
+
+// Several parts per thread, so that a slow one doesn't hold up the rest
+static size_t partCount()
+{
+	return (workers().size() + 1) * 4;
+}
+
+/**
+ * Sums a contiguous run of pixels. Parts start on 64 byte boundaries,
+ * on the sampling phase of the stride, so they read the same pixels a single pass would.
+ */
+static RgbSums sumRun(const PixelFormat &fmt, const uint8_t *buf, uint64_t count, uint64_t stride, Histogram *hist)
+{
+	if (!parallel(count / stride))
+		return fmt.sum(buf, count, stride, hist);
+
+	const uint64_t bpp   = uint64_t(fmt.bytes_per_pixel);
+	const uint64_t align = 64 / std::gcd(uint64_t(64), bpp) * stride;
+	const uint64_t parts = partCount();
+	const uint64_t chunk = ((count + parts - 1) / parts + align - 1) / align * align;
+
+	return reduceParts(size_t((count + chunk - 1) / chunk), hist, [&] (size_t i, Histogram *h) {
+		const uint64_t begin = i * chunk;
+		return fmt.sum(buf + begin * bpp, std::min(chunk, count - begin), stride, h);
+	});
+}
+
+/**
+ * Sums every pixel of a rectangle, split by rows when it's large.
+ */
+static RgbSums sumRows(const PixelFormat &fmt, const uint8_t *buf, int bytes_per_line, int x, int y, int w, int h, Histogram *hist)
+{
+	const auto rows = [&] (int begin, int end, Histogram *hg) {
+		RgbSums s;
+		for (int cy = begin; cy < end; ++cy)
+			s += fmt.sum(buf + int64_t(y + cy) * bytes_per_line + int64_t(x) * fmt.bytes_per_pixel, uint64_t(w), 1, hg);
+		return s;
+	};
+
+	if (!parallel(uint64_t(w) * h))
+		return rows(0, h, hist);
+
+	const int parts = int(std::min(partCount(), size_t(h)));
+
+	return reduceParts(size_t(parts), hist, [&] (size_t i, Histogram *hg) {
+		return rows(int(int64_t(i) * h / parts), int(int64_t(i + 1) * h / parts), hg);
+	});
+}
+
+/**
+ * For buffers known to hold BGRx (or BGR) pixels.
+ */
 int calcBrightness(uint8_t *buf, uint64_t buf_sz, int bytes_per_pixel, int stride)
 {
+	if (bytes_per_pixel == 4) {
+		const PixelFormat bgrx;
+		Histogram  local;
+		Histogram *h = useHistogram(nullptr, local);
+		return brtMetric(bgrx, sumRun(bgrx, buf, buf_sz / 4, uint64_t(std::max(1, stride)), h), local);
+	}
+
 	uint64_t rgb[3] {};
 	for (uint64_t i = 0, inc = stride * bytes_per_pixel; i < buf_sz; i += inc) {
 		rgb[0] += buf[i + 2];
@@ -22,6 +181,41 @@ int calcBrightness(uint8_t *buf, uint64_t buf_sz, int bytes_per_pixel, int strid
 	return (rgb[0] * 0.2126 + rgb[1] * 0.7152 + rgb[2] * 0.0722) * stride / (buf_sz / bytes_per_pixel);
 }
 
+/**
+ * Brightness of a whole image in any pixel format.
+ * Rows without padding are read as a single run.
+ */
+int calcImageBrightness(const PixelFormat &fmt, const uint8_t *buf, int width, int height, int bytes_per_line, int stride, Histogram *hist)
+{
+	if (bytes_per_line != width * fmt.bytes_per_pixel)
+		return calcRegionBrightness(fmt, buf, bytes_per_line, 0, 0, width, height, stride, hist);
+
+	Histogram  local;
+	Histogram *h = useHistogram(hist, local);
+
+	return brtMetric(fmt, sumRun(fmt, buf, uint64_t(width) * height, uint64_t(std::max(1, stride)), h), h ? *h : local);
+}
+
+/**
+ * Same as calcImageBrightness, but limited to a rectangle of a larger image.
+ * The stride counts pixels inside the rectangle, so rows are followed properly.
+ */
+int calcRegionBrightness(const PixelFormat &fmt, const uint8_t *buf, int bytes_per_line, int x, int y, int w, int h, int stride, Histogram *hist)
+{
+	const int bytes_per_pixel = fmt.bytes_per_pixel;
+
+	Histogram  local;
+	Histogram *hg = useHistogram(hist, local);
+
+	// Dense regions are read row by row
+	if (stride <= 1)
+		return brtMetric(fmt, sumRows(fmt, buf, bytes_per_line, x, y, w, h, hg), hg ? *hg : local);
+
+	const uint8_t *px = buf + int64_t(y) * bytes_per_line + int64_t(x) * bytes_per_pixel;
+
+	return brtMetric(fmt, fmt.sumRect(px, bytes_per_line, w, h, uint64_t(stride), hg), hg ? *hg : local);
+}
+
 double lerp(double x, double a, double b)
 {
 	return (1 - x) * a + x * b;
@@ -39,7 +233,7 @@ double remap(double x, double a, double b, double ay, double by)
 
 double interpTemp(int temp_step, size_t color_ch)
 {
-	return remap(temp_steps_max - temp_step, 0, temp_steps_max, ingo_thies_table[color_ch], 1);
+	return temp_multipliers[std::clamp(temp_step, 0, temp_steps_max)][color_ch];
 };
 
 double easeOutExpo(double t, double b , double c, double d)
@@ -8,8 +8,16 @@
 
 #include <cstddef>
 #include <cstdint>
+#include "luma.h"
 
+/* The brightness functions return the metric set in brt_metric.
+ * Given a histogram, they also fill it. */
 int    calcBrightness(uint8_t *buf, uint64_t buf_sz, int bytes_per_pixel, int stride);
+int    calcImageBrightness(const PixelFormat &fmt, const uint8_t *buf, int width, int height, int bytes_per_line, int stride, Histogram *hist = nullptr);
+int    calcRegionBrightness(const PixelFormat &fmt, const uint8_t *buf, int bytes_per_line, int x, int y, int w, int h, int stride, Histogram *hist = nullptr);
+bool   brtUsesHistogram();
+int    brtMetric(const PixelFormat &fmt, const RgbSums &s, const Histogram &hist);
+int    brtMetric(const double *bins);
 double lerp(double x, double a, double b);
 double normalize(double x, double a, double b);
 double remap(double x, double a, double b, double ay, double by);
@@ -0,0 +1,201 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <cctype>
+#include <mutex>
+#include "weights.h"
+#include "cfg.h"
+#include "defs.h"
+
+Weighting weightingFromName(const std::string &name)
+{
+	if (name == "center")
+		return Weighting::center;
+	if (name == "window")
+		return Weighting::window;
+	if (name == "mask")
+		return Weighting::mask;
+
+	return Weighting::none;
+}
+
+// Mask ------------------------------------------------------------------
+
+/**
+ * Reads a binary PGM (P5) file. Any image editor can save one.
+ */
+static std::shared_ptr<const WeightMask> loadMask(const std::string &path)
+{
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file) {
+		LOGE << "Unable to open weight mask: " << path;
+		return nullptr;
+	}
+
+	// Header fields, skipping whitespace and comments
+	const auto field = [&file] {
+		int c;
+		while ((c = file.peek()) != EOF) {
+			if (c == '#')
+				file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+			else if (std::isspace(c))
+				file.get();
+			else
+				break;
+		}
+		std::string s;
+		file >> s;
+		return s;
+	};
+
+	auto mask = std::make_shared<WeightMask>();
+	int  maxval = 0;
+
+	try {
+		if (field() != "P5")
+			throw std::invalid_argument("not a binary PGM");
+		mask->width  = std::stoi(field());
+		mask->height = std::stoi(field());
+		maxval       = std::stoi(field());
+	} catch (const std::exception &e) {
+		LOGE << "Invalid weight mask " << path << ": " << e.what();
+		return nullptr;
+	}
+
+	if (mask->width <= 0 || mask->height <= 0 || maxval <= 0 || maxval > 255) {
+		LOGE << "Unsupported weight mask " << path << " (8 bit grayscale only)";
+		return nullptr;
+	}
+
+	// A single whitespace separates the header from the pixels
+	file.get();
+
+	mask->px.resize(size_t(mask->width) * mask->height);
+	file.read(reinterpret_cast<char*>(mask->px.data()), std::streamsize(mask->px.size()));
+
+	if (!file) {
+		LOGE << "Weight mask " << path << " is truncated";
+		return nullptr;
+	}
+
+	if (maxval != 255) {
+		for (auto &p : mask->px)
+			p = uint8_t(std::min(255, p * 255 / maxval));
+	}
+
+	LOGI << "Weight mask: " << path << " (" << mask->width << '*' << mask->height << ')';
+
+	return mask;
+}
+
+// WeightMap -------------------------------------------------------------
+
+WeightMap::WeightMap(int width, int height, Weighting mode, Rect focus, int outside, std::shared_ptr<const WeightMask> mask)
+    : width(width), height(height), mode(mode), focus(focus), outside(std::clamp(outside, 0, max)), mask(std::move(mask))
+{
+	// Without a focused window there's nothing to favor
+	if (mode == Weighting::window && focus.empty())
+		this->mode = Weighting::none;
+
+	if (mode == Weighting::mask && !this->mask)
+		this->mode = Weighting::none;
+
+	if (width <= 0 || height <= 0)
+		this->mode = Weighting::none;
+}
+
+bool WeightMap::uniform() const noexcept
+{
+	return mode == Weighting::none;
+}
+
+int WeightMap::at(int x, int y) const noexcept
+{
+	switch (mode) {
+	case Weighting::center: {
+		// From 1 in the corners to max in the middle, falling off with the squared distance
+		const double dx = double(2 * x + 1 - width) / width;
+		const double dy = double(2 * y + 1 - height) / height;
+		const double d2 = std::min(1., (dx * dx + dy * dy) / 2);
+		return max - int(std::lround((max - 1) * d2));
+	}
+	case Weighting::window:
+		return (x >= focus.x && x < focus.x + focus.w && y >= focus.y && y < focus.y + focus.h) ? max : outside;
+	case Weighting::mask: {
+		const int mx = int(int64_t(x) * mask->width / width);
+		const int my = int(int64_t(y) * mask->height / height);
+		return (mask->px[size_t(my) * mask->width + mx] * max + 127) / 255;
+	}
+	default:
+		return 1;
+	}
+}
+
+/**
+ * Mean weight of a rectangle, from a few points spread over it.
+ */
+int WeightMap::average(const Rect &r) const noexcept
+{
+	if (uniform() || r.empty())
+		return 1;
+
+	constexpr int n = 4;
+	int sum = 0;
+
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < n; ++j)
+			sum += at(r.x + (2 * j + 1) * r.w / (2 * n), r.y + (2 * i + 1) * r.h / (2 * n));
+
+	return (sum + n * n / 2) / (n * n);
+}
+
+bool WeightMap::operator==(const WeightMap &o) const noexcept
+{
+	if (mode != o.mode || width != o.width || height != o.height)
+		return false;
+
+	switch (mode) {
+	case Weighting::window:
+		return focus == o.focus && outside == o.outside;
+	case Weighting::mask:
+		return mask == o.mask;
+	default:
+		return true;
+	}
+}
+
+/**
+ * The mask set in brt_weight_mask. It's loaded once, and again when the path changes.
+ */
+static std::shared_ptr<const WeightMask> brtMask()
+{
+	static std::mutex mtx;
+	static std::string mask_path;
+	static std::shared_ptr<const WeightMask> mask;
+
+	std::lock_guard lock(mtx);
+	const std::string path = cfg["brt_weight_mask"];
+
+	if (path != mask_path) {
+		mask_path = path;
+		mask = path.empty() ? nullptr : loadMask(path);
+	}
+
+	return mask;
+}
+
+WeightMap brtWeights(int width, int height, const Rect &focus)
+{
+	const Weighting mode    = weightingFromName(cfg["brt_weight"]);
+	const int       outside = int(std::lround(std::clamp(cfg["brt_weight_outside"].get<double>(), 0., 1.) * WeightMap::max));
+
+	return WeightMap(width, height, mode, focus, outside, mode == Weighting::mask ? brtMask() : nullptr);
+}
@@ -0,0 +1,75 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef WEIGHTS_H
+#define WEIGHTS_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * A rectangle of an image, in its own coordinates.
+ */
+struct Rect
+{
+	int x = 0, y = 0, w = 0, h = 0;
+
+	bool empty() const noexcept { return w <= 0 || h <= 0; }
+	bool operator==(const Rect &o) const noexcept { return x == o.x && y == o.y && w == o.w && h == o.h; }
+};
+
+/**
+ * Which parts of the screen count more towards its brightness.
+ */
+enum class Weighting { none, center, window, mask };
+
+Weighting weightingFromName(const std::string &name);
+
+/**
+ * 8 bit grayscale image, stretched over each monitor.
+ */
+struct WeightMask
+{
+	int width  = 0;
+	int height = 0;
+	std::vector<uint8_t> px;
+};
+
+/**
+ * Integer weights (0 to max) over an image.
+ * Only used while building sample grids and tiles, so that
+ * capturing sums each weight level separately with no per pixel cost.
+ */
+class WeightMap
+{
+public:
+	static constexpr int max = 16;
+
+	WeightMap() = default;
+	WeightMap(int width, int height, Weighting mode, Rect focus = {}, int outside = max, std::shared_ptr<const WeightMask> mask = nullptr);
+
+	bool uniform() const noexcept;
+	int  at(int x, int y) const noexcept;
+	int  average(const Rect &r) const noexcept;
+	bool operator==(const WeightMap &o) const noexcept;
+	bool operator!=(const WeightMap &o) const noexcept { return !(*this == o); }
+private:
+	int       width   = 0;
+	int       height  = 0;
+	Weighting mode    = Weighting::none;
+	Rect      focus;
+	int       outside = max;
+	std::shared_ptr<const WeightMask> mask;
+};
+
+/**
+ * The weights set by brt_weight for an image of the given size.
+ * The focus is the part of the image covered by the active window, if known.
+ */
+WeightMap brtWeights(int width, int height, const Rect &focus = {});
+
+#endif // WEIGHTS_H
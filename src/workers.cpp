@@ -0,0 +1,119 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <algorithm>
+#include "workers.h"
+#include "cfg.h"
+
+WorkerPool::WorkerPool(size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		threads.emplace_back([this] { work(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard lock(mtx);
+		quit = true;
+	}
+
+	work_cv.notify_all();
+
+	for (auto &t : threads)
+		t.join();
+}
+
+size_t WorkerPool::size() const noexcept
+{
+	return threads.size();
+}
+
+/**
+ * Takes tasks until there are none left. Both the workers and the caller run this.
+ */
+size_t WorkerPool::drain(const std::function<void(size_t)> &fn, size_t n)
+{
+	size_t done = 0;
+
+	for (size_t i = next++; i < n; i = next++) {
+		fn(i);
+		++done;
+	}
+
+	return done;
+}
+
+void WorkerPool::work()
+{
+	uint64_t seen = 0;
+
+	std::unique_lock lock(mtx);
+
+	while (true) {
+		work_cv.wait(lock, [&] { return quit || generation != seen; });
+
+		if (quit)
+			return;
+
+		seen = generation;
+
+		// Woke up after the job was over
+		if (tasks == 0)
+			continue;
+
+		const auto  *fn = job;
+		const size_t n  = tasks;
+		++active;
+
+		lock.unlock();
+		const size_t done = drain(*fn, n);
+		lock.lock();
+
+		finished += done;
+		--active;
+		done_cv.notify_all();
+	}
+}
+
+void WorkerPool::run(size_t n, const std::function<void(size_t)> &fn)
+{
+	if (n == 0)
+		return;
+
+	std::lock_guard run_lock(run_mtx);
+
+	{
+		std::lock_guard lock(mtx);
+		job      = &fn;
+		tasks    = n;
+		finished = 0;
+		next     = 0;
+		++generation;
+	}
+
+	work_cv.notify_all();
+	const size_t done = drain(fn, n);
+
+	/* Once every worker that took the job has left drain(), nobody can touch it anymore.
+	 * Late ones find no tasks. */
+	std::unique_lock lock(mtx);
+	finished += done;
+	done_cv.wait(lock, [&] { return finished == tasks && active == 0; });
+	job   = nullptr;
+	tasks = 0;
+}
+
+WorkerPool& workers()
+{
+	static WorkerPool pool([] {
+		const int n = cfg["brt_threads"].get<int>();
+		if (n > 0)
+			return size_t(n);
+		return size_t(std::clamp(int(std::thread::hardware_concurrency()) - 1, 1, 3));
+	}());
+
+	return pool;
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "defs.h"
+
+/**
+ * A few threads kept around for splitting large reductions.
+ * The calling thread works on the tasks too, so it's never idle while waiting.
+ */
+class WorkerPool
+{
+public:
+	WorkerPool(size_t threads);
+	~WorkerPool();
+
+	/**
+	 * Calls fn(i) for every i in [0, tasks) and returns once all of them are done.
+	 * Calls from different threads are run one after the other.
+	 */
+	void run(size_t tasks, const std::function<void(size_t)> &fn);
+	size_t size() const noexcept;
+private:
+	std::vector<std::thread> threads;
+	std::mutex run_mtx;
+	std::mutex mtx;
+	convar     work_cv;
+	convar     done_cv;
+
+	const std::function<void(size_t)> *job = nullptr;
+	std::atomic<size_t> next { 0 };
+	size_t   tasks      = 0;
+	size_t   finished   = 0;
+	int      active     = 0;
+	uint64_t generation = 0;
+	bool     quit       = false;
+
+	void   work();
+	size_t drain(const std::function<void(size_t)> &fn, size_t n);
+};
+
+/**
+ * The pool used by the brightness reductions, sized from brt_threads on first use.
+ * With 0, it uses one thread less than the cores, up to 3.
+ */
+WorkerPool& workers();
+
+#endif // WORKERS_H
@@ -0,0 +1,45 @@
+/**
+ * Copyright (C) Francesco Fusco. All rights reserved.
+ * License: https://github.com/Fushko/gammy#license
+ */
+
+#include <cstdio>
+#include <vector>
+#include "ramp.h"
+#include "defs.h"
+
+/**
+ * Every brightness and temperature step, at the common ramp sizes.
+ */
+int main()
+{
+	int failed = 0;
+
+	for (int ramp_sz : { 256, 1024, 2048, 4096 }) {
+		const size_t n = size_t(ramp_sz);
+		std::vector<uint16_t> simd(3 * n), scalar(3 * n);
+
+		for (int brt = 0; brt <= brt_steps_max; ++brt) {
+			for (int temp = 0; temp <= temp_steps_max; ++temp) {
+				fillRamp(&simd[0], &simd[n], &simd[2 * n], ramp_sz, brt, temp);
+				fillRampScalar(&scalar[0], &scalar[n], &scalar[2 * n], ramp_sz, brt, temp);
+
+				if (simd != scalar) {
+					if (failed < 10)
+						printf("Mismatch: ramp size %d, brightness %d, temperature %d\n", ramp_sz, brt, temp);
+					++failed;
+				}
+			}
+		}
+
+		printf("Ramp size %d checked\n", ramp_sz);
+	}
+
+	if (failed) {
+		printf("FAIL: %d ramps differ\n", failed);
+		return 1;
+	}
+
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Checks that the SIMD gamma ramps match the scalar ones.
+# Run with: qmake && make check
+#
+#-------------------------------------------------
+
+TARGET   = ramp-test
+TEMPLATE = app
+CONFIG  += c++1z console thread testcase
+CONFIG  -= qt app_bundle
+
+SRC = $$PWD/../../src
+
+HEADERS += $$SRC/ramp.h $$SRC/utils.h $$SRC/cfg.h $$SRC/defs.h
+
+SOURCES += main.cpp \
+    $$SRC/ramp.cpp \
+    $$SRC/utils.cpp \
+    $$SRC/cfg.cpp \
+    $$SRC/luma.cpp \
+    $$SRC/workers.cpp \
+    $$SRC/weights.cpp
+
+INCLUDEPATH += $$SRC $$PWD/../../include